@@ -24,6 +24,12 @@
    Definitions of flags stored in EEPROM of the uC.
  */
 
+#define SERIAL_NUM_ADDR 0xF0       // Start of the board's USB serial number (up to 8 ASCII characters padded with 0xFF).
+#define SERIAL_NUM_MAX_LEN 8
+
+#define TCK_FREQ_ADDR 0xFB         // Code for the TCK frequency.
+#define TCK_FREQ_CHECK_ADDR 0xFC   // Complement of the TCK frequency code (the code is ignored if this doesn't match).
+
 #define JTAG_DISABLE_FLAG_ADDR 0xFD
 #define DISABLE_JTAG 0x69
 
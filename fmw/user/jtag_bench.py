@@ -0,0 +1,282 @@
+#!/usr/bin/env python
+#
+# Host-side benchmark for the JTAG commands of the XuLA2 USB firmware.
+#
+# It measures the round-trip time of a small command and the throughput of JTAG_CMD shifts (TDI only,
+# TDI with TDO returned, and TDI with the TDO folded into a CRC), and of the older TDI_CMD, TDO_CMD and
+# TDI_TDO_CMD that the existing host tools still send. Run it once against each build being
+# compared (for example USE_USB_POLLING 0 and 1, or 32- and 64-byte packets) with the FPGA in a known
+# state; only the speed is measured, so the TDO bits themselves don't matter.
+#
+# It also has the host side of COMM_MODE_TDO_RLE: rle_decode() expands the compressed TDO bytes, and
+# --rle adds a compressed TDI+TDO case when the firmware is built with USE_TDO_RLE. rle_encode() makes
+# the same literals and runs as the firmware, and --selftest checks that they decode back to the
+# original bytes (no board is needed for that).
+#
+# Needs pyusb (pip install pyusb) and access to the board's USB device.
+#
+#   python jtag_bench.py [--bits N] [--iters N] [--freq HZ] [--rle]
+#   python jtag_bench.py --selftest
+#
+
+from __future__ import print_function
+
+import argparse
+import random
+import struct
+import threading
+import time
+
+VID = 0x04D8
+PID = 0xFF8C
+EP_OUT = 0x01
+EP_IN = 0x81
+TIMEOUT_MS = 5000
+
+# Command codes and JTAG_CMD flags (see usbcmd.h and user.c).
+JTAG_CMD = 0x4f
+RUNTEST_CMD = 0x47
+TDI_TDO_CMD = 0x44
+TDO_CMD = 0x45
+TDI_CMD = 0x46
+SET_TCK_FREQ_CMD = 0x55
+SET_COMM_MODE_CMD = 0x56
+COMM_MODE_PACKET = 0x00
+COMM_MODE_TDO_RLE = 0x40
+GET_TDO_MASK = 0x01
+PUT_TDI_MASK = 0x08
+CRC_TDO_MASK = 0x80
+JTAG_CMD_HDR_LEN = 6
+LEGACY_CMD_HDR_LEN = 5
+CRC_RSP_LEN = 9
+
+# Literals and runs of TDI_RLE_CMD and COMM_MODE_TDO_RLE (see TDI_RLE_HDR_LEN in user.c). A code byte below
+# 0x80 is followed by code + 1 literal bytes. Otherwise bit 6 selects a run of 0x00 or 0xFF bytes, and bits
+# 5-0 of the code and the next byte hold the length of the run minus one.
+RLE_RUN_MASK = 0x80
+RLE_ONES_MASK = 0x40
+RLE_LEN_MASK = 0x3F
+RLE_MAX_RUN = (RLE_LEN_MASK + 1) * 256
+RLE_MAX_LIT = 0x80
+
+
+def rle_encode(data):
+    """Compress bytes into literals and runs the same way as the firmware's RleTdoBytes()."""
+    out = bytearray()
+    lit = [None]    # Index of the code of the open literal.
+
+    def literal(b):
+        if lit[0] is None or out[lit[0]] == RLE_MAX_LIT - 1:
+            lit[0] = len(out)
+            out.append(0xFF)
+        out.append(b)
+        out[lit[0]] = (out[lit[0]] + 1) & 0xFF
+
+    def end_run(b, n):
+        # A short run costs less as part of a literal.
+        if n == 1 or (n == 2 and lit[0] is not None):
+            for _ in range(n):
+                literal(b)
+            return
+        out.append(RLE_RUN_MASK | (RLE_ONES_MASK if b else 0) | ((n - 1) >> 8))
+        out.append((n - 1) & 0xFF)
+        lit[0] = None
+
+    run_byte, run_len = None, 0
+    for b in bytearray(data):
+        if run_len:
+            if b == run_byte and run_len < RLE_MAX_RUN:
+                run_len += 1
+                continue
+            end_run(run_byte, run_len)
+            run_len = 0
+        if b in (0x00, 0xFF):
+            run_byte, run_len = b, 1
+        else:
+            literal(b)
+    if run_len:
+        end_run(run_byte, run_len)
+    return bytes(out)
+
+
+def rle_decode(data):
+    """Expand literals and runs back into the original bytes."""
+    data = bytearray(data)
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code & RLE_RUN_MASK:
+            if i + 1 >= len(data):
+                raise ValueError('Run code at offset %d has no length byte.' % i)
+            n = ((code & RLE_LEN_MASK) << 8 | data[i + 1]) + 1
+            out += bytearray([0xFF if code & RLE_ONES_MASK else 0x00]) * n
+            i += 2
+        else:
+            n = code + 1
+            if i + 1 + n > len(data):
+                raise ValueError('Literal at offset %d runs past the end.' % i)
+            out += data[i + 1:i + 1 + n]
+            i += 1 + n
+    return bytes(out)
+
+
+def rle_selftest():
+    """Check that compressed bytes decode back to the original ones, including the edge cases of the format."""
+    rng = random.Random(1)
+    cases = [b'', b'\x00', b'\xff', b'\x12', b'\x00\x00', b'\x12\x00\x00', b'\x00\x00\x12',
+             b'\x00' * RLE_MAX_RUN, b'\xff' * (RLE_MAX_RUN + 1), b'\x5a' * (RLE_MAX_LIT + 1),
+             bytes(bytearray(range(256)) * 3)]
+    for _ in range(500):
+        # Mostly 0x00 and 0xFF, like TDO from a bypassed or idle chain, with some other bytes mixed in.
+        cases.append(bytes(bytearray(rng.choice((0x00, 0xFF, 0x00, 0xFF, rng.randrange(256)))
+                                     for _ in range(rng.randrange(1, 600)))))
+    for data in cases:
+        packed = rle_encode(data)
+        if rle_decode(packed) != data:
+            raise SystemExit('RLE round trip failed for %d bytes.' % len(data))
+    print('RLE round trip OK for %d buffers.' % len(cases))
+
+
+def open_board():
+    import usb.core
+    dev = usb.core.find(idVendor=VID, idProduct=PID)
+    if dev is None:
+        raise SystemExit('No XuLA board found.')
+    dev.set_configuration()
+    ep_size = dev.get_active_configuration()[(0, 0)][0].wMaxPacketSize
+    return dev, ep_size
+
+
+def read_bytes(dev, ep_size, num_bytes):
+    """Read num_bytes from the IN endpoint, however they are split into packets."""
+    data = bytearray()
+    while len(data) < num_bytes:
+        data += dev.read(EP_IN, ep_size, TIMEOUT_MS)
+    return data
+
+
+def fence(dev, ep_size):
+    """Wait until the commands sent so far are done by doing a zero-length RUNTEST."""
+    dev.write(EP_OUT, struct.pack('<BI', RUNTEST_CMD, 0), TIMEOUT_MS)
+    read_bytes(dev, ep_size, 5)
+
+
+def round_trip(dev, ep_size, iters):
+    """Average time for a one-clock RUNTEST command and its 5-byte acknowledgement."""
+    cmd = struct.pack('<BI', RUNTEST_CMD, 1)
+    start = time.time()
+    for _ in range(iters):
+        dev.write(EP_OUT, cmd, TIMEOUT_MS)
+        read_bytes(dev, ep_size, 5)
+    return (time.time() - start) / iters
+
+
+def read_rle_tdo(dev, ep_size, num_bytes):
+    """Read compressed TDO packets up to the short (or empty) one that ends them and expand them."""
+    packed = bytearray()
+    while True:
+        pkt = dev.read(EP_IN, ep_size, TIMEOUT_MS)
+        packed += pkt
+        if len(pkt) < ep_size:
+            break
+    data = rle_decode(packed)
+    if len(data) != num_bytes:
+        raise SystemExit('Got %d TDO bytes from the compressed response instead of %d.' % (len(data), num_bytes))
+    return data
+
+
+def set_tdo_rle(dev, ep_size, enable):
+    """Turn TDO compression on or off and return whether the firmware accepted it."""
+    mode = COMM_MODE_PACKET | (COMM_MODE_TDO_RLE if enable else 0)
+    dev.write(EP_OUT, struct.pack('<BB', SET_COMM_MODE_CMD, mode), TIMEOUT_MS)
+    return bool(read_bytes(dev, ep_size, 2)[1] & COMM_MODE_TDO_RLE)
+
+
+def jtag_shift(dev, ep_size, num_bits, flags, rle=False):
+    """Time a JTAG_CMD that shifts num_bits TDI bits and returns the TDO bits as the flags ask."""
+    num_bytes = (num_bits + 7) // 8
+    stream = struct.pack('<BIB', JTAG_CMD, num_bits, flags) + bytes(bytearray(num_bytes))
+    if flags & CRC_TDO_MASK:
+        rsp_len = CRC_RSP_LEN
+    elif flags & GET_TDO_MASK:
+        rsp_len = num_bytes
+    else:
+        rsp_len = 0
+
+    # The TDO packets come back while the TDI packets are still going out, so read them in another thread.
+    rsp = []
+    read = read_rle_tdo if rle else read_bytes
+    reader = threading.Thread(target=lambda: rsp.append(read(dev, ep_size, rsp_len)))
+    start = time.time()
+    reader.start()
+    for i in range(0, len(stream), ep_size):
+        dev.write(EP_OUT, stream[i:i + ep_size], TIMEOUT_MS)
+    reader.join()
+    if rsp_len == 0:
+        fence(dev, ep_size)
+    return time.time() - start
+
+
+def legacy_shift(dev, ep_size, num_bits, cmd):
+    """Time a TDI_CMD, TDO_CMD or TDI_TDO_CMD of num_bits bits."""
+    num_bytes = (num_bits + 7) // 8
+    hdr = struct.pack('<BI', cmd, num_bits)
+    assert len(hdr) == LEGACY_CMD_HDR_LEN
+    # These commands come in a packet by themselves and their TDI bytes start in the next packet.
+    tdi = bytes(bytearray(num_bytes)) if cmd != TDO_CMD else b''
+    rsp_len = num_bytes if cmd != TDI_CMD else 0
+
+    rsp = []
+    reader = threading.Thread(target=lambda: rsp.append(read_bytes(dev, ep_size, rsp_len)))
+    start = time.time()
+    reader.start()
+    dev.write(EP_OUT, hdr, TIMEOUT_MS)
+    for i in range(0, len(tdi), ep_size):
+        dev.write(EP_OUT, tdi[i:i + ep_size], TIMEOUT_MS)
+    reader.join()
+    if rsp_len == 0:
+        fence(dev, ep_size)
+    return time.time() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the XuLA2 JTAG firmware.')
+    parser.add_argument('--bits', type=int, default=8 * 1024 * 1024, help='bits shifted by each JTAG_CMD')
+    parser.add_argument('--iters', type=int, default=1000, help='round trips to average')
+    parser.add_argument('--freq', type=int, default=12000000, help='TCK frequency to request')
+    parser.add_argument('--rle', action='store_true', help='also time TDI+TDO with the TDO compressed')
+    parser.add_argument('--selftest', action='store_true', help='check the RLE encoder and decoder and exit')
+    args = parser.parse_args()
+
+    if args.selftest:
+        rle_selftest()
+        return
+
+    dev, ep_size = open_board()
+    dev.write(EP_OUT, struct.pack('<BI', SET_TCK_FREQ_CMD, args.freq), TIMEOUT_MS)
+    freq = struct.unpack('<BI', bytes(read_bytes(dev, ep_size, 5)))[1]
+    print('Packet size: %d bytes, TCK: %d Hz' % (ep_size, freq))
+
+    print('Round trip:     %8.1f us' % (round_trip(dev, ep_size, args.iters) * 1e6))
+    for name, flags in (('TDI:', PUT_TDI_MASK),
+                        ('TDI+TDO:', PUT_TDI_MASK | GET_TDO_MASK),
+                        ('TDI+TDO CRC:', PUT_TDI_MASK | GET_TDO_MASK | CRC_TDO_MASK)):
+        secs = jtag_shift(dev, ep_size, args.bits, flags)
+        print('%-15s %8.1f kbit/s' % (name, args.bits / secs / 1000))
+    for name, cmd in (('TDI_CMD:', TDI_CMD),
+                      ('TDO_CMD:', TDO_CMD),
+                      ('TDI_TDO_CMD:', TDI_TDO_CMD)):
+        secs = legacy_shift(dev, ep_size, args.bits, cmd)
+        print('%-15s %8.1f kbit/s' % (name, args.bits / secs / 1000))
+    if args.rle:
+        if not set_tdo_rle(dev, ep_size, True):
+            print('TDI+TDO RLE:    not supported (build the firmware with USE_TDO_RLE 1)')
+        else:
+            secs = jtag_shift(dev, ep_size, args.bits, PUT_TDI_MASK | GET_TDO_MASK, rle=True)
+            set_tdo_rle(dev, ep_size, False)
+            print('%-15s %8.1f kbit/s' % ('TDI+TDO RLE:', args.bits / secs / 1000))
+
+
+if __name__ == '__main__':
+    main()
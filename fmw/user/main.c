@@ -358,6 +358,8 @@ void USBCBErrorHandler( void )
  *****************************************************************************/
 void USBCBCheckOtherReq( void )
 {
+    ServiceSerialNumRequest();  // Return the serial number string that is stored in EEPROM.
+    ServiceVendorRequest();     // Handle housekeeping commands sent as vendor requests.
 } //end
 
 
@@ -549,7 +551,11 @@ BOOL USER_USB_CALLBACK_EVENT_HANDLER( USB_EVENT event, void *pdata, WORD size )
             break;
 
         case EVENT_TRANSFER:
+            #if USE_RX_RING
+            FillRxRing();   // Move any packets received from the host into the receive ring.
+            #else
             Nop();
+            #endif
             break;
 
         default:
@@ -58,7 +58,29 @@
 // application related data.
 
 #define USB_MAX_NUM_INT 1           // For tracking Alternate Setting
+// Set USE_DATA_EP to 1 to add a second bulk endpoint pair. The JTAG commands and their streams of data then go
+// through EP2 while EP1 handles quick status commands that can be answered in the middle of a long stream.
+#define USE_DATA_EP 0
+// Set USE_EVENT_EP to 1 to add an interrupt IN endpoint (EP2) that notifies the host of events such as
+// changes of the FPGA DONE pin. There isn't enough USB RAM for both this and the data endpoint.
+#define USE_EVENT_EP 0
+// Set USE_RX_RING to 1 to copy received packets into a ring in general-purpose RAM from the USB interrupt.
+// This gives the host more slack than the two ping-pong endpoint buffers. The ring holds four packets in the rxram
+// bank of the linker script, which only has room for them at 32 bytes, so the packets are 32 bytes in this build.
+#define USE_RX_RING 0
+// Set USE_64_BYTE_PACKETS to 0 to go back to 32-byte JTAG packets. The 256 bytes of USB RAM hold 48 bytes of buffer
+// descriptors and EP0 buffers, so with 64-byte packets there is only room for one IN buffer next to the two OUT
+// buffers and the TDO packets aren't ping-ponged. With 32-byte packets both IN buffers fit. (Compare the two builds
+// with jtag_bench.py.)
+#define USE_64_BYTE_PACKETS 1
+#if USE_DATA_EP && USE_EVENT_EP
+#error "There is not enough USB RAM for both the data and event endpoints."
+#endif
+#if USE_DATA_EP || USE_EVENT_EP
+#define USB_MAX_EP_NUMBER 2
+#else
 #define USB_MAX_EP_NUMBER 1
+#endif
 
 //Device descriptor - if these two definitions are not defined then
 //  a ROM USB_DEVICE_DESCRIPTOR variable by the exact name of device_dsc
@@ -79,8 +101,14 @@
 //#define USB_PING_PONG_MODE USB_PING_PONG__ALL_BUT_EP0		//NOTE: This mode is not supported in PIC18F4550 family rev A3 devices
 
 
-//#define USB_POLLING
+// Set USE_USB_POLLING to 1 to run the USB stack from the main loop and at the packet boundaries of the JTAG
+// commands instead of from the high-priority interrupt, so it can't break into the cycle-counted JTAG loops.
+#define USE_USB_POLLING 0
+#if USE_USB_POLLING
+#define USB_POLLING
+#else
 #define USB_INTERRUPT
+#endif
 
 /* Parameter definitions are defined in usb_device.h */
 #define USB_PULLUP_OPTION USB_PULLUP_ENABLE
@@ -101,6 +129,7 @@
 #define USB_SUPPORT_DEVICE
 
 #define USB_NUM_STRING_DESCRIPTORS 3
+#define USB_SERIAL_NUM_STRING_INDEX 3   // The serial number string is built in RAM from EEPROM, so it isn't in USB_SD_Ptr.
 
 //#define USB_INTERRUPT_LEGACY_CALLBACKS
 #define USB_ENABLE_ALL_HANDLERS
@@ -120,8 +149,24 @@
 /** ENDPOINTS ALLOCATION *******************************************/
 
 /* Generic */
+// The larger buffer descriptor table and the control or event endpoint buffers leave only enough USB RAM
+// for 32-byte packets when the data or event endpoint is used.
+#if USE_DATA_EP
+#define USBGEN_EP_SIZE 32U
+#define USBGEN_EP_NUM 2U
+#define USBCTRL_EP_NUM 1U
+#elif USE_EVENT_EP
+#define USBGEN_EP_SIZE 32U
+#define USBGEN_EP_NUM 1U
+#define EVENT_EP_NUM 2U
+#define EVENT_EP_SIZE 8U
+#elif USE_64_BYTE_PACKETS && !USE_RX_RING
+#define USBGEN_EP_SIZE 64U
+#define USBGEN_EP_NUM 1U
+#else
 #define USBGEN_EP_SIZE 32U
 #define USBGEN_EP_NUM 1U
+#endif
 
 /** DEFINITIONS ****************************************************/
 
@@ -177,7 +177,7 @@ ROM USB_DEVICE_DESCRIPTOR device_dsc
     USB_FMW_VERSION,        // Device release number in BCD format (put firmware version here and in user.c!!)
     0x01,                   // Manufacturer string index
     0x02,                   // Product string index
-    0x00,                   // Device serial number string index
+    USB_SERIAL_NUM_STRING_INDEX,    // Device serial number string index (built from EEPROM in user.c)
     0x01                    // Number of possible configurations
     };
 
@@ -186,7 +186,13 @@ ROM BYTE configDescriptor1 [] = {
     /* Configuration Descriptor */
     0x09, //sizeof(USB_CFG_DSC),    // Size of this descriptor in bytes
     USB_DESCRIPTOR_CONFIGURATION,                // CONFIGURATION descriptor type
+#if USE_DATA_EP
+    0x2E, 0x00,           // Total length of data for this cfg
+#elif USE_EVENT_EP
+    0x27, 0x00,           // Total length of data for this cfg
+#else
     0x20, 0x00,           // Total length of data for this cfg
+#endif
     1,                      // Number of interfaces in this cfg
     1,                      // Index value of this configuration
     0,                      // Configuration string index
@@ -198,7 +204,13 @@ ROM BYTE configDescriptor1 [] = {
     USB_DESCRIPTOR_INTERFACE,               // INTERFACE descriptor type
     0,                      // Interface Number
     0,                      // Alternate Setting Number
+#if USE_DATA_EP
+    4,                      // Number of endpoints in this intf
+#elif USE_EVENT_EP
+    3,                      // Number of endpoints in this intf
+#else
     2,                      // Number of endpoints in this intf
+#endif
     0xFF,                   // Class code
     0xFF,                   // Subclass code
     0xFF,                   // Protocol code
@@ -218,6 +230,32 @@ ROM BYTE configDescriptor1 [] = {
     _BULK,                       //Attributes
     USBGEN_EP_SIZE, 0x00,       //size
     1                          //Interval
+#if USE_DATA_EP
+    ,
+    /* Endpoint Descriptors for the JTAG data endpoint */
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_OUT,                  //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE, 0x00,       //size
+    1,                         //Interval
+
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_IN,                   //EndpointAddress
+    _BULK,                       //Attributes
+    USBGEN_EP_SIZE, 0x00,       //size
+    1                          //Interval
+#elif USE_EVENT_EP
+    ,
+    /* Endpoint Descriptor for the event notifications */
+    0x07,                       /*sizeof(USB_EP_DSC)*/
+    USB_DESCRIPTOR_ENDPOINT,    //Endpoint Descriptor
+    _EP02_IN,                   //EndpointAddress
+    _INTERRUPT,                 //Attributes
+    EVENT_EP_SIZE, 0x00,        //size
+    1                          //Interval
+#endif
 };
 
 
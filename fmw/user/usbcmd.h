@@ -22,6 +22,8 @@
 
 /**
 Definitions of commands sent in USB packets.
+ID_BOARD, INFO, PROG, FLASH_ONOFF and the AIO ADC commands can also be sent as vendor control
+requests on EP0 with the command as the request number and its parameter in wValue.
 */
 typedef enum
 {
@@ -48,12 +50,28 @@ typedef enum
     SINGLE_TEST_VECTOR_CMD = 0x4a,  // ** Send a single, byte-wide test vector.
     GET_TEST_VECTOR_CMD    = 0x4b,  // ** Read the current test vector being output.
     SET_OSC_FREQ_CMD       = 0x4c,  // ** Set the frequency of the DS1075 oscillator.
-    ENABLE_RETURN_CMD      = 0x4d,  // ** Enable return of info in response to a command.
-    DISABLE_RETURN_CMD     = 0x4e,  // ** Disable return of info in response to a command.
+    ENABLE_RETURN_CMD      = 0x4d,  // Enable return of acknowledgements in response to a command.
+    DISABLE_RETURN_CMD     = 0x4e,  // Disable return of acknowledgements in response to a command (posted mode).
     JTAG_CMD               = 0x4f,  // Send multiple TMS & TDI bits while receiving multiple TDO bits.
     FLASH_ONOFF_CMD        = 0x50,  // Enable/disable the FPGA configuration flash.
+    SCAN_IR_CMD            = 0x51,  // Shift bits through the instruction register and go to an end state.
+    SCAN_DR_CMD            = 0x52,  // Shift bits through the data register and go to an end state.
+    SCAN_DR_SEGS_CMD       = 0x53,  // Shift a list of segments through the data register with an update after each one.
+    POLL_DR_CMD            = 0x54,  // Repeat a DR scan until the TDO bits match a value or a limit is reached.
+    SET_TCK_FREQ_CMD       = 0x55,  // Set the frequency of TCK and store it in EEPROM.
+    SET_COMM_MODE_CMD      = 0x56,  // Select packet or framed byte-stream mode for the commands, ZLP-ended responses and TDO compression.
+    SYNC_CMD               = 0x57,  // Return the status accumulated since the last sync.
+    FLUSH_CMD              = 0x58,  // Send any small responses that are waiting to be returned.
+    SET_COALESCE_CMD       = 0x59,  // Set the timeout for collecting small responses into a packet (0 = off).
+    SET_EVENTS_CMD         = 0x5a,  // Select the events sent through the interrupt endpoint and set the ADC limits.
+    RX_STATS_CMD           = 0x5b,  // Return and clear the receive ring statistics.
+    SET_SERIAL_NUM_CMD     = 0x5c,  // Store the USB serial number of the board in EEPROM.
+    SCAN_IR_CMP_CMD        = 0x5d,  // Shift bits through the IR and compare the TDO bits under a mask on the device.
+    SCAN_DR_CMP_CMD        = 0x5e,  // Shift bits through the DR and compare the TDO bits under a mask on the device.
+    SET_TDO_WINDOWS_CMD    = 0x5f,  // Return only the TDO bits in a few windows from the next command that gathers TDO.
     AIO0_ADC_CMD           = 0x60,  // Do an ADC conversion on AIO0 (AN6 pin on pic)
     AIO1_ADC_CMD           = 0x61,  // Do an ADC conversion on AIO1 (AN11 pin on pic)
+    TDI_RLE_CMD            = 0x62,  // Send multiple TDI bits given as run-length encoded literals and runs.
     RESET_CMD              = 0xff   // Cause a power-on reset.
 } USBCMD;
 
@@ -28,6 +28,7 @@
 //
 //********************************************************************
 
+#include <delays.h>
 #include "USB/usb.h"
 #include "USB/usb_function_generic.h"
 #include "HardwareProfile.h"
@@ -46,9 +47,9 @@ typedef struct DEVICE_INFO
     CHAR8 version_id[2];
     struct
     {
-        // description string is size of max. USB packet minus storage for
-        // product ID, device ID, checksum and command.
-        CHAR8 str[USBGEN_EP_SIZE - 2 - 2 - 1 - 1];
+        // description string is size of the original 32-byte USB packet minus storage for
+        // product ID, device ID, checksum and command. (Hosts expect this size for the INFO_CMD reply.)
+        CHAR8 str[32 - 2 - 2 - 1 - 1];
     }     desc;
     CHAR8 checksum;
 } DEVICE_INFO;
@@ -86,6 +87,12 @@ typedef union DATA_PACKET
     {
         USBCMD cmd;
         DWORD  num_tck_pulses;
+        DWORD  min_time_us;
+    };
+    struct // SET_TCK_FREQ_CMD structure
+    {
+        USBCMD cmd;
+        DWORD  tck_freq;
     };
     struct
     {
@@ -98,6 +105,96 @@ typedef union DATA_PACKET
         DWORD  num_clks;
         BYTE   flags;
     };
+    struct // Response to a command that folds its TDO bits into a CRC
+    {
+        USBCMD cmd;
+        DWORD  tdo_crc;
+        DWORD  crc_bits;
+    };
+    struct // SCAN_IR_CMD and SCAN_DR_CMD structure
+    {
+        USBCMD cmd;
+        DWORD  num_clks;
+        BYTE   flags;
+        BYTE   end_state;
+    };
+    struct // SCAN_IR_CMP_CMD and SCAN_DR_CMP_CMD response structure
+    {
+        USBCMD cmd;
+        BYTE   cmp_fail;
+        DWORD  cmp_offset;
+    };
+    struct // SCAN_DR_SEGS_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   seg_flags;
+        BYTE   seg_end_state;
+        BYTE   num_segs;
+        WORD   seg_len[(USBGEN_EP_SIZE - 4) / 2];
+    };
+    struct // POLL_DR_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   poll_len;
+        BYTE   poll_end_state;
+        WORD   poll_max_iters;
+        WORD   poll_time_limit;
+        BYTE   poll_data[USBGEN_EP_SIZE - 7];
+    };
+    struct // POLL_DR_CMD response structure
+    {
+        USBCMD cmd;
+        BYTE   poll_match;
+        WORD   poll_iters;
+        BYTE   poll_tdo[USBGEN_EP_SIZE - 4];
+    };
+    struct // SET_COMM_MODE_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   mode;
+    };
+    struct // SYNC_CMD response structure
+    {
+        USBCMD cmd;
+        BYTE   status;
+        WORD   num_cmds;
+    };
+    struct // SET_COALESCE_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   coalesce_ticks;
+    };
+    struct // SET_EVENTS_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   event_mask;
+        BYTE   adc_chan;
+        WORD   limit_low;
+        WORD   limit_high;
+    };
+    struct // RX_STATS_CMD response structure
+    {
+        USBCMD cmd;
+        BYTE   rx_ring_len;
+        BYTE   rx_high_water;
+        WORD   rx_full_cnt;
+    };
+    struct // SET_SERIAL_NUM_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   serial_len;
+        CHAR8  serial_num[SERIAL_NUM_MAX_LEN];
+    };
+    struct // SET_TDO_WINDOWS_CMD structure
+    {
+        USBCMD cmd;
+        BYTE   num_windows;
+        struct
+        {
+            DWORD start;
+            BYTE  len;
+        }      window[(USBGEN_EP_SIZE - 2) / 5];
+    };
     struct // FLASH_ONOFF_CMD
     {
         USBCMD cmd;
@@ -130,13 +227,222 @@ typedef union DATA_PACKET
 #define TMS_VAL_MASK 0x04                       // Static value for TMS if PUT_TMS_MASK is cleared.
 #define PUT_TDI_MASK 0x08                       // Set if TDI bits are included in the packets.
 #define TDI_VAL_MASK 0x10                       // Static value for TDI if PUT_TDI_MASK is cleared.
+#define TMS_RLE_MASK 0x20                       // Set if TMS is given as a list of runs instead of in the packets.
+#define RAW_ORDER_MASK 0x40                     // Set if the TDI/TDO bytes are MSB-first so they don't need to be bit-reversed.
+#define CRC_TDO_MASK 0x80                       // Set if the TDO bytes are folded into a CRC32 instead of being returned.
+
+// With CRC_TDO_MASK, the response is just the command, the CRC32 (IEEE 802.3, the same as zlib's crc32) of the
+// TDO bytes exactly as they would have been returned, and the number of bits. TDO_CMD and TDI_TDO_CMD take the
+// same flags byte after the number of bits, but only CRC_TDO_MASK is used and the byte is optional.
+#define CRC_RSP_LEN 9
+
+// SCAN_IR_CMP_CMD and SCAN_DR_CMP_CMD have the same header as SCAN_IR_CMD and SCAN_DR_CMD, but for each eight
+// bits the host sends a TDI byte (unless PUT_TDI_MASK is cleared), an expected TDO byte and a mask byte. Only the
+// TDO bits with a 1 in the mask are compared. The response is the command, a byte that is 1 if any bit didn't
+// match, and the offset of the first bit that didn't match (NO_MISMATCH if they all matched).
+#define CMP_RSP_LEN 6
+#define NO_MISMATCH 0xFFFFFFFFUL
+
+// SET_TDO_WINDOWS_CMD has the number of windows followed by the starting bit offset (little-endian dword) and the
+// number of bits in each window. The windows must be in order and can't overlap. They apply to the next TDO_CMD,
+// TDI_TDO_CMD, JTAG_CMD, SCAN_IR_CMD, SCAN_DR_CMD or SCAN_DR_SEGS_CMD that gathers TDO bits (and isn't folding them
+// into a CRC). That command returns just the bits in the windows packed together, starting with the LSB of the
+// first byte, and then the windows are cleared. Offsets count the TDO bits in the order they were captured, which
+// is MSB-first within each byte for RAW_ORDER_MASK. The offsets for a SCAN_DR_SEGS_CMD run on from one segment to
+// the next without the padding of each segment's last byte. Bits in a window past the end of the scan are returned as 0.
+#define MAX_TDO_WINDOWS 4                       // Maximum number of capture windows.
+#define TDO_WIN_BYTES   8                       // Space for the captured bits of all the windows.
+
+// A JTAG_CMD with run-length-encoded TMS has a byte with the number of TMS runs right after the
+// command header, followed by a little-endian word for each run. Bit 15 of the word is the TMS level
+// and the lower bits hold the number of clocks in the run. The TDI bits follow the list of runs.
+#define MAX_TMS_RUNS        12                  // Maximum number of TMS runs in a command (more are rejected).
+#define TMS_RUN_LEVEL_MASK  0x8000              // TMS level bit of a run.
+#define TMS_RUN_LEN_MASK    0x7FFF              // Length bits of a run.
+
+// Definitions for SCAN_IR_CMD and SCAN_DR_CMD. The flags byte uses the GET_TDO, PUT_TDI, TDI_VAL and RAW_ORDER bits of JTAG_CMD.
+#define SCAN_CMD_HDR_LEN 7
+
+// A SCAN_DR_SEGS_CMD has a header with the flags, end state and number of segments followed by a little-endian
+// word with the number of bits in each segment. The TDI bits of each segment start on a new byte, and so do the
+// TDO bits that are returned for each segment.
+#define SCAN_SEGS_HDR_LEN   4
+#define MAX_SCAN_SEGS       12                  // Maximum number of DR segments in one command.
+
+// A POLL_DR_CMD has a header with the number of DR bits, the end state, the maximum number of iterations
+// and the time limit (in milliseconds), followed by the TDI bits, the mask and the compare value. These
+// each take the same number of bytes and must all fit in the command packet. An iteration or time limit
+// of zero means there is no limit, but the scan is done only once if both are zero. The response holds
+// a match flag, the number of iterations done and the TDO bits from the final scan. A command with no DR bits
+// or with more than fit in the packet gets just the response header with POLL_REJECTED as the match flag.
+#define POLL_CMD_HDR_LEN    7
+#define POLL_RSP_HDR_LEN    4
+#define POLL_REJECTED       0xFF                // Match flag of a POLL_DR_CMD that wasn't done.
+#define MAX_POLL_BYTES      ( ( USBGEN_EP_SIZE - POLL_CMD_HDR_LEN ) / 3 )
+
+// A TDI_RLE_CMD has the number of TDI bits after the command, followed by the TDI bytes (LSB-first, like TDI_CMD)
+// encoded as literals and runs. A code byte below 0x80 is followed by code + 1 literal bytes. Otherwise, bit 6 of
+// the code selects a run of 0x00 or 0xFF bytes, and bits 5-0 of the code and the next byte hold the length of the
+// run minus one. TMS is raised on the last bit to leave the Shift state, the same as TDI_CMD.
+#define TDI_RLE_HDR_LEN     5
+#define TDI_RLE_RUN_MASK    0x80                // Set if the code starts a run.
+#define TDI_RLE_ONES_MASK   0x40                // Set if the run is 0xFF bytes.
+#define TDI_RLE_LEN_MASK    0x3F                // Upper bits of the run length.
+
+// With COMM_MODE_TDO_RLE, the TDO bytes returned by JTAG_CMD, SCAN_IR_CMD, SCAN_DR_CMD and SCAN_DR_SEGS_CMD are
+// compressed with the same literals and runs as TDI_RLE_CMD. Every packet is full except the last one, which can
+// also be empty (a ZLP is sent after a full one if COMM_MODE_ZLP is set). The host knows how many TDO bytes to
+// expect, so it keeps reading and decoding until it has all of them.
+#define TDO_RLE_MAX_RUN     ( ( TDI_RLE_LEN_MASK + 1 ) * 256U )  // Longest run that fits in a run code.
+#define TDO_RLE_MAX_LIT     0x80                // Most bytes in a literal.
+#define TDO_RLE_BUF_LEN     ( USBGEN_EP_SIZE + 4 )  // Most compressed bytes from one packet of TDO bytes.
+#define NO_RLE_LIT          0xFF                // No literal is open.
+
+// States of the JTAG TAP controller. These codes are also used for the end state of a scan command.
+#define TAP_RESET       0
+#define TAP_IDLE        1
+#define TAP_SELECT_DR   2
+#define TAP_CAPTURE_DR  3
+#define TAP_SHIFT_DR    4
+#define TAP_EXIT1_DR    5
+#define TAP_PAUSE_DR    6
+#define TAP_EXIT2_DR    7
+#define TAP_UPDATE_DR   8
+#define TAP_SELECT_IR   9
+#define TAP_CAPTURE_IR  10
+#define TAP_SHIFT_IR    11
+#define TAP_EXIT1_IR    12
+#define TAP_PAUSE_IR    13
+#define TAP_EXIT2_IR    14
+#define TAP_UPDATE_IR   15
+#define TAP_UNKNOWN     16              // The TAP state is not known, so the TAP has to be reset before it can be moved.
 
 #define MIPS 12                         // Number of processor instructions per microsecond.
 #define MAX_BYTE_VAL 0xFF               // Maximum value that can be stored in a byte.
 #define NUM_ACTIVITY_BLINKS 10          // Indicate activity by blinking the LED this many times.
 #define BLINK_SCALER 10                 // Make larger to stretch the time between LED blinks.
-#define DO_DELAY_THRESHOLD 5461UL       // Threshold between pulsing TCK or using a timer = (1000000 / (12000000 / 256))
+#define DO_DELAY_THRESHOLD 5461UL       // Microseconds between decrements of the runtest timer = (1000000 / (12000000 / 65536))
+#define RUNTEST_TIME_LEN   9            // Length of a RUNTEST_CMD packet that also has a minimum wall time in microseconds.
+
+// Codes for the TCK frequency. The three fastest settings use the MSSP clock options when only TDI/TDO bits are shifted.
+// The other codes bit-bang TCK with a delay of 10 * (code - TCK_CODE_BB + 1) instruction cycles in each half of a pulse.
+#define TCK_CODE_12MHZ  0               // MSSP at Fosc/4. The fixed-timing assembly loops are used.
+#define TCK_CODE_3MHZ   1               // MSSP at Fosc/16.
+#define TCK_CODE_750KHZ 2               // MSSP at Fosc/64.
+#define TCK_CODE_BB     3               // First of the bit-banged settings.
+#define TCK_BB_BIT_CYCLES 80            // Instruction cycles ShiftJtagBits() spends on each bit outside its two delays. This is
+                                        // an estimate from the loop's code: C18 reaches the locals and the flags argument
+                                        // through FSR2, the TMS run count is a DWORD, and each Delay10TCYx() call adds its
+                                        // own call and argument overhead.
+#define TCK_BB_CYCLES(code) ( 20UL * ( (code) - TCK_CODE_BB + 1 ) + TCK_BB_BIT_CYCLES )  // Cycles per bit-banged TCK pulse.
 #define USE_MSSP     1                  // True if driving JTAG with MSSP block; false to use bit-banging.
+#define USE_TDO_RLE  0                  // True to allow compressing TDO with COMM_MODE_TDO_RLE (needs a packet-sized buffer of RAM).
+
+// There is only room in the USB RAM for both OUT buffers and a single IN buffer when the packets are 64 bytes.
+#if USBGEN_EP_SIZE > 32
+#define NUM_IN_BUFFERS  1
+#else
+#define NUM_IN_BUFFERS  2
+#endif
+#define IN_INDEX_TOGGLE ( NUM_IN_BUFFERS - 1 )  // XOR with InIndex to move to the next IN buffer (if there is one).
+
+// Ways of receiving commands from the host. In packet mode, each packet starts with a command and anything left
+// in the packet after the command is finished gets dropped. In stream mode, the packets form a stream of bytes
+// in which each command is preceded by a byte with the length of its header (the command byte and parameters).
+// Any TMS/TDI bits for the command follow the header, and the next command starts right after them. Commands
+// can share packets or be split across them. (The older TDI/TDO/TDI_TDO commands only work in packet mode.)
+#define COMM_MODE_PACKET    0
+#define COMM_MODE_STREAM    1
+// Flag ORed into the mode that makes the firmware send a zero-length packet after a response whose last packet
+// is full. The host can then make one large read for a whole response because a short packet always ends it.
+#define COMM_MODE_ZLP       0x80
+// Flag ORed into the mode that compresses the TDO bytes of JTAG and scan commands (if the firmware is built with it).
+#define COMM_MODE_TDO_RLE   0x40
+
+// Bits of the status that accumulates until a SYNC_CMD reports it.
+#define STATUS_BAD_CMD      0x01        // An unknown command (or one not allowed in stream mode) was received.
+#define STATUS_BAD_PARAM    0x02        // A command had parameters that couldn't be handled, so it was ignored.
+#define STATUS_BAD_FRAME    0x04        // A garbled command header was found in the byte stream.
+
+// Small responses can be collected into a single IN packet instead of being sent one per packet. They're sent
+// when the packet fills, when a FLUSH_CMD or a command with a large or streaming response arrives, or when the
+// coalescing timeout (in ticks of the runtest timer, 5.461 ms) expires while waiting for the next command.
+#define NO_COALESCE         0xFF        // Response length for commands whose responses aren't collected.
+
+// Number of bytes to return for an acknowledgement, which is nothing when acknowledgements are disabled (posted mode).
+#define ACK_BYTES( n )      ( return_enabled ? ( n ) : 0 )
+
+#define STATUS_EVENT_LOST   0x08        // An event was dropped because the event queue was full.
+
+// Records of events that are sent to the host through the interrupt endpoint.
+typedef struct EVENT
+{
+    BYTE type;                          // Type of event.
+    BYTE arg;                           // The command or ADC channel the event is about.
+    WORD value;                         // The command count or ADC reading when the event occurred.
+} EVENT;
+#define EVENT_DONE_RISE     0x01        // The FPGA DONE pin went high.
+#define EVENT_DONE_FALL     0x02        // The FPGA DONE pin went low.
+#define EVENT_CMD_DONE      0x03        // A command that can take a long time has finished.
+#define EVENT_ADC_HIGH      0x04        // The ADC reading went above the high limit.
+#define EVENT_ADC_LOW       0x05        // The ADC reading went below the low limit.
+#define EVENT_MASK_DONE     0x01        // Bit in the event mask that enables DONE pin events.
+#define EVENT_MASK_CMD      0x02        // Bit in the event mask that enables command completion events.
+#define EVENT_MASK_ADC      0x04        // Bit in the event mask that enables ADC limit events.
+#define EVENT_QUEUE_LEN     8           // Number of events that can wait to be sent (must be a power of 2).
+#define ADC_BETWEEN         0           // The last ADC reading was between the limits.
+#define ADC_BELOW           1           // The last ADC reading was below the low limit.
+#define ADC_ABOVE           2           // The last ADC reading was above the high limit.
+
+// Check the event queue only when the event endpoint is present.
+#if USE_EVENT_EP
+#define SERVICE_EVENTS()    ServiceEvents()
+#else
+#define SERVICE_EVENTS()
+#endif
+
+// Access to the packets received from the host. Normally these work directly on the ping-pong endpoint buffers.
+// With the receive ring, the USB interrupt copies each received packet into a ring in general-purpose RAM and
+// re-arms the endpoint buffer right away, so the host can keep sending while the JTAG loops are busy.
+#if USE_RX_RING
+#define RX_RING_LEN     4           // Number of packets in the receive ring (must be a power of 2).
+#define OUT_BUSY()      ( rx_count == 0U )
+#define OUT_BUFFER()    ( &RxRing[rx_tail] )
+#define OUT_LENGTH()    ( rx_len[rx_tail] )
+#define OUT_RELEASE()   ReleaseRxPacket()
+#else
+#define RX_RING_LEN     0
+#define OUT_BUSY()      USBHandleBusy( OutHandle[OutIndex] )
+#define OUT_BUFFER()    ( &OutBuffer[OutIndex] )
+#define OUT_LENGTH()    USBHandleGetLength( OutHandle[OutIndex] )
+#define OUT_RELEASE()   OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE ), OutIndex ^= 1
+#endif
+
+// Check the control endpoint for a status command whenever the firmware is waiting on the data endpoint.
+#if USE_DATA_EP
+#define SERVICE_CTRL()      ServiceControl()
+#else
+#define SERVICE_CTRL()
+#endif
+
+// Run the USB stack at the points where the firmware waits if it isn't run from the interrupt.
+#if defined( USB_POLLING )
+#define SERVICE_USB()       USBDeviceTasks()
+#else
+#define SERVICE_USB()
+#endif
+
+// Everything that is done while waiting for a packet to arrive or be sent on the primary endpoint.
+#define SERVICE_WAIT()      { SERVICE_USB(); SERVICE_CTRL(); }
+
+// Enable the MSSP to drive the JTAG pins. The TCK output is disabled so the clock won't glitch when the MSSP is enabled.
+// The MSSP clock is set to the selected TCK frequency.
+#define MSSP_ON()       TCK_TRIS = INPUT_PIN, SSPCON1 = tck_sspcon1, SSPCON1bits.SSPEN = 1, TCK_TRIS = OUTPUT_PIN
+// Disable the MSSP so the JTAG pins can be bit-banged. The MSSP clock goes back to Fosc/4 for the older JTAG commands.
+#define MSSP_OFF()      TCK = 0, SSPCON1 = 0
+
+// Wait for half of a TCK period when TCK is bit-banged at a reduced frequency.
+#define TCK_DELAY()     if ( tck_delay ) Delay10TCYx( tck_delay )
 
 
 #pragma romdata
@@ -148,6 +454,48 @@ static const rom DEVICE_INFO device_info
     0x00                // Checksum (filled in later).
     }; // Change version in usb_descriptors.c as well!!
 
+// Next state of the TAP controller for each state. The low nibble is the next state if TMS is 0 and
+// the high nibble is the next state if TMS is 1.
+static rom const BYTE tap_next [] = {
+    0x01,   // Test-Logic-Reset
+    0x21,   // Run-Test/Idle
+    0x93,   // Select-DR-Scan
+    0x54,   // Capture-DR
+    0x54,   // Shift-DR
+    0x86,   // Exit1-DR
+    0x76,   // Pause-DR
+    0x84,   // Exit2-DR
+    0x21,   // Update-DR
+    0x0A,   // Select-IR-Scan
+    0xCB,   // Capture-IR
+    0xCB,   // Shift-IR
+    0xFD,   // Exit1-IR
+    0xED,   // Pause-IR
+    0xFB,   // Exit2-IR
+    0x21,   // Update-IR
+};
+
+// Level of TMS that moves the TAP controller along the shortest path toward a target state.
+// Bit N of the entry for a target state holds the TMS level to use when the TAP is in state N.
+static rom const WORD tap_tms_to [] = {
+    0xFFFE, // Test-Logic-Reset
+    0x7EFC, // Run-Test/Idle
+    0xFFFA, // Select-DR-Scan
+    0xFFF2, // Capture-DR
+    0xFF42, // Shift-DR
+    0xFF5A, // Exit1-DR
+    0xFF1A, // Pause-DR
+    0xFF5A, // Exit2-DR
+    0xFEFA, // Update-DR
+    0xFDFE, // Select-IR-Scan
+    0xF9FE, // Capture-IR
+    0xA1FE, // Shift-IR
+    0xADFE, // Exit1-IR
+    0x8DFE, // Pause-IR
+    0xADFE, // Exit2-IR
+    0x7DFE, // Update-IR
+};
+
 // This table is used to reverse the bits within a byte.  The table has to be located at
 // the beginning of a page because we index into the table by placing the byte value
 // whose bits are to be reversed into TBLPTRL without changing TBLPTRH or TBLPTRU.
@@ -175,6 +523,11 @@ static rom const BYTE reverse_bits [] = {
 static near DWORD lcntr;                    // Large counter for fast loops.
 static near BYTE buffer_cntr;               // Holds the number of bytes left to process in the USB packet.
 static near WORD save_FSR0, save_FSR1;      // Used for saving the contents of PIC hardware registers.
+static near BYTE tms_bits, tdi_bits, tdo_bits;  // Bytes of TMS, TDI and TDO bits being shifted by the bit-banging loops.
+static near BYTE crc_b0, crc_b1, crc_b2, crc_b3, crc_x; // Copy of the TDO CRC (LSB first) and a scratch byte for CrcTdoBytes().
+#if USE_RX_RING
+static near BYTE rx_copy_cntr;              // Bytes left to copy into the receive ring (used in the USB interrupt).
+#endif
 
 #pragma udata
 static USB_HANDLE OutHandle[2] = {0,0}; // Handles to endpoint buffers that are receiving packets from the host.
@@ -184,11 +537,102 @@ static BYTE OutPacketLength    = 0;     // Length (in bytes) of most-recently re
 static USB_HANDLE InHandle[2]  = {0,0}; // Handles to ping-pong endpoint buffers that are sending packets to the host.
 static BYTE InIndex            = 0;     // Index of the endpoint buffer that is currently being filled before being sent to the host.
 static DATA_PACKET *InPacket;           // Pointer to the buffer that is currently being filled.
+static BYTE *tms_tdi;                   // Pointer to the buffer of received TMS & TDI bits.
+static BYTE *tdo;                       // Pointer to the buffer for returning TDO bits.
+static BYTE out_left;                   // Number of TMS & TDI bytes left to process in the received packet.
+static WORD tms_runs[MAX_TMS_RUNS];     // Runs of TMS bits for a JTAG_CMD with run-length-encoded TMS.
+static BYTE num_tms_runs;               // Number of TMS runs in the list.
+static BYTE tms_run_index;              // Index of the next TMS run to load.
+static DWORD tms_run_left;              // Number of clocks left in the current TMS run.
+static BYTE tap_state = TAP_UNKNOWN;    // Current state of the TAP controller in the JTAG device.
+static WORD scan_segs[MAX_SCAN_SEGS];   // Number of bits in each segment of a SCAN_DR_SEGS_CMD.
+static WORD us_timer_ovfls;             // Number of times TIMER1 has overflowed since the microsecond timer was started.
+static BYTE tck_code    = TCK_CODE_12MHZ;   // Code for the selected TCK frequency.
+static BYTE tck_sspcon1 = 0;            // MSSP control register setting for the selected TCK frequency.
+static BYTE tck_delay   = 0;            // Delay (in units of 10 instruction cycles) for each half of a bit-banged TCK pulse.
+static BYTE comm_mode   = COMM_MODE_PACKET;  // How commands are received from the host.
+static BOOL out_held    = FALSE;        // True when a packet of the command stream is being processed.
+static DATA_PACKET CmdPacket;           // Holds the header of the current command in stream mode.
+static BOOL return_enabled = TRUE;      // False when acknowledgements are not returned (posted mode).
+static BYTE cmd_status  = 0;            // Status bits accumulated since the last SYNC_CMD.
+static WORD num_cmds_done = 0;          // Number of commands processed since the last SYNC_CMD.
+static BYTE coalesce_ticks = 0;         // Timeout for sending collected responses (0 disables coalescing).
+static BYTE in_fill     = 0;            // Number of bytes of collected responses in the current IN packet.
+static WORD in_fill_tick;               // Runtest timer value when the first response was collected.
+static BOOL zlp_enabled = FALSE;        // True if responses that end with a full packet are followed by a zero-length packet.
+static BOOL last_in_full;               // True if the last packet of the current response was full.
+static BYTE rx_high_water = 0;          // Most packets that have been waiting in the receive ring.
+static WORD rx_full_cnt = 0;            // Number of packets that had to wait for room in the receive ring.
+static struct
+{
+    BYTE bLength;
+    BYTE bDscType;
+    WORD string[SERIAL_NUM_MAX_LEN];
+} serial_dsc;                           // USB serial number string descriptor built from the ID in EEPROM.
+static BOOL crc_tdo     = FALSE;        // True if the TDO bytes of the current command are folded into a CRC.
+static DWORD tdo_crc;                   // CRC of the TDO bytes of the current command.
+static BYTE num_windows  = 0;           // Number of TDO capture windows waiting for the next command.
+static DWORD win_start[MAX_TDO_WINDOWS];    // First TDO bit in each capture window.
+static BYTE win_len[MAX_TDO_WINDOWS];   // Number of TDO bits in each capture window.
+static BOOL win_tdo     = FALSE;        // True if only the TDO bits in the windows are returned for the current command.
+static BOOL win_msb_first;              // True if the TDO bytes being windowed are MSB-first.
+static DWORD win_bit;                   // Offset of the first TDO bit in the next byte to be windowed.
+static DWORD win_next;                  // Offset of the next TDO bit to capture.
+static BYTE win_left;                   // Number of bits left to capture in the current window.
+static BYTE win_index;                  // Index of the current window.
+static BYTE win_fill;                   // Number of bits captured so far.
+static BYTE win_total;                  // Number of bits in all the windows.
+static BYTE win_buf[TDO_WIN_BYTES];     // Captured TDO bits packed together.
+#if USE_TDO_RLE
+static BOOL tdo_rle_enabled = FALSE;    // True if the TDO bytes of JTAG and scan commands are compressed.
+static BOOL rle_tdo     = FALSE;        // True if the TDO bytes of the current command are being compressed.
+static BYTE rle_fill;                   // Number of compressed bytes at the start of the IN packet (the raw TDO bytes follow).
+static BYTE rle_run_byte;               // TDO byte repeated in the pending run.
+static WORD rle_run_len;                // Number of bytes in the pending run (0 if there isn't one).
+static BYTE rle_lit;                    // Index of the code of the open literal in the buffer (NO_RLE_LIT if none).
+static BYTE rle_len;                    // Number of compressed bytes in the buffer.
+static BYTE rle_buf[TDO_RLE_BUF_LEN];   // Compressed TDO bytes from the raw bytes in the IN packet.
+#endif
+static BYTE vendor_rsp[sizeof( DEVICE_INFO ) + 1];  // Response to a vendor request on EP0 (must persist until it is sent).
 WORD runtest_timer;                     // Timer for RUNTEST command.
 
 #pragma udata usbram2
-static DATA_PACKET InBuffer[2];     // Ping-pong buffers in USB RAM for sending packets to host.
+static DATA_PACKET InBuffer[NUM_IN_BUFFERS];    // Ping-pong buffers in USB RAM for sending packets to host.
 static DATA_PACKET OutBuffer[2];    // Ping-pong buffers in USB RAM for receiving packets from host.
+#if USE_DATA_EP
+static DATA_PACKET CtrlInBuffer;    // Buffer in USB RAM for sending status to the host through the control endpoint.
+static DATA_PACKET CtrlOutBuffer;   // Buffer in USB RAM for receiving commands through the control endpoint.
+#pragma udata
+static USB_HANDLE CtrlInHandle  = 0;    // Handle to the control endpoint buffer that is sending a packet to the host.
+static USB_HANDLE CtrlOutHandle = 0;    // Handle to the control endpoint buffer that is receiving a packet from the host.
+#endif
+#if USE_RX_RING
+#pragma udata rxring
+static DATA_PACKET RxRing[RX_RING_LEN]; // Packets received from the host that are waiting to be processed.
+#pragma udata
+static BYTE rx_len[RX_RING_LEN];        // Lengths of the packets in the receive ring.
+static BYTE rx_head     = 0;            // Index where the next received packet is stored.
+static BYTE rx_tail     = 0;            // Index of the packet being processed.
+static BYTE rx_count    = 0;            // Number of packets in the receive ring.
+static BOOL rx_enabled  = FALSE;        // True once the endpoint buffers are armed and can be moved into the ring.
+static BOOL rx_stalled  = FALSE;        // True while a received packet is waiting for room in the ring.
+#endif
+#if USE_EVENT_EP
+#pragma udata usbram2
+static EVENT EventBuffer[EVENT_EP_SIZE / sizeof( EVENT )];  // Buffer in USB RAM for sending events to the host.
+#pragma udata
+static USB_HANDLE EventHandle = 0;      // Handle to the event endpoint buffer that is sending events to the host.
+static EVENT event_queue[EVENT_QUEUE_LEN];  // Events waiting to be sent.
+static BYTE event_head  = 0;            // Index where the next event is posted.
+static BYTE event_tail  = 0;            // Index of the next event to send.
+static BYTE event_mask  = 0;            // Types of events that are sent to the host.
+static BYTE event_adc_chan = 0x6;       // ADC channel that is checked against the limits.
+static WORD event_adc_low  = 0;         // An ADC reading below this is an event.
+static WORD event_adc_high = 0x3FF;     // An ADC reading above this is an event.
+static BYTE adc_level   = ADC_BETWEEN;  // Where the last ADC reading was compared to the limits.
+static WORD adc_tick;                   // Runtest timer value when the ADC was last read.
+static BOOL last_done;                  // Last value of the DONE pin.
+#endif
 
 
 #pragma code
@@ -212,8 +656,134 @@ void WriteEeprom(BYTE address, BYTE data)
     while(EECON1bits.WR);       //Wait till WR bit is clear
 }
 
+//
+// Do an ADC conversion on the given channel. The result is left in ADRESH and ADRESL.
+//
+static void ConvertAdc( BYTE chan )
+{
+    ADCON0bits.CHS = chan;          // select channel
+    ADCON0bits.GO = 1;              // Start AD conversion
+    while(ADCON0bits.NOT_DONE);     // Wait for conversion
+}
+
+//
+// Read the runtest timer without it being changed by the timer interrupt in the middle of the read.
+//
+static WORD GetRuntestTimer( void )
+{
+    WORD ticks;
+
+    INTCONbits.GIEL = 0;
+    ticks           = runtest_timer;
+    INTCONbits.GIEL = 1;
+    return ticks;
+}
+
+//
+// Set the TCK frequency from its code.
+//
+static void SetTckCode( BYTE code )
+{
+    tck_code = code;
+    switch ( code )
+    {
+        case TCK_CODE_12MHZ:
+            tck_sspcon1 = 0b00000000;   // SPI master mode, clock = Fosc/4.
+            tck_delay   = 0;
+            break;
+        case TCK_CODE_3MHZ:
+            tck_sspcon1 = 0b00000001;   // SPI master mode, clock = Fosc/16.
+            tck_delay   = 0;            // (Testing the delay already stretches bit-banged pulses enough.)
+            break;
+        case TCK_CODE_750KHZ:
+            tck_sspcon1 = 0b00000010;   // SPI master mode, clock = Fosc/64.
+            tck_delay   = 1;
+            break;
+        default:
+            tck_sspcon1 = 0b00000000;   // The MSSP isn't used.
+            tck_delay   = code - TCK_CODE_BB + 1;
+            break;
+    }
+}
+
+
+
+//
+// Return the code for the highest TCK frequency that doesn't exceed the given frequency.
+//
+static BYTE GetTckCode( DWORD freq )
+{
+    DWORD delay;
+
+    if ( freq >= 12000000UL )
+        return TCK_CODE_12MHZ;
+    if ( freq >= 3000000UL )
+        return TCK_CODE_3MHZ;
+    if ( freq >= 750000UL )
+        return TCK_CODE_750KHZ;
+    if ( freq == 0U )
+        return MAX_BYTE_VAL;    // Slowest setting.
+    delay = ( 12000000UL + freq - 1 ) / freq;    // Instruction cycles per TCK pulse.
+    if ( delay <= TCK_BB_CYCLES( TCK_CODE_BB ) )
+        return TCK_CODE_BB;
+    delay = ( delay - TCK_BB_BIT_CYCLES + 19 ) / 20;  // Round the delay up so the frequency doesn't exceed freq.
+    if ( delay > MAX_BYTE_VAL - TCK_CODE_BB + 1 )
+        delay = MAX_BYTE_VAL - TCK_CODE_BB + 1;
+    return (BYTE)delay + TCK_CODE_BB - 1;
+}
+
+
+
+//
+// Return the TCK frequency for a code. (For the bit-banged settings, this is an estimate because
+// the time to process each bit, TCK_BB_BIT_CYCLES, adds to the delay.)
+//
+static DWORD GetTckFreq( BYTE code )
+{
+    switch ( code )
+    {
+        case TCK_CODE_12MHZ:
+            return 12000000UL;
+        case TCK_CODE_3MHZ:
+            return 3000000UL;
+        case TCK_CODE_750KHZ:
+            return 750000UL;
+        default:
+            return 12000000UL / TCK_BB_CYCLES( code );
+    }
+}
+
+
+
+//
+// Build the USB serial number string descriptor from the board ID stored in EEPROM. The ID ends at the first
+// character that isn't printable ASCII, and the descriptor is left empty if the board has no ID.
+//
+static void LoadSerialNumber( void )
+{
+    BYTE i, c;
+
+    for ( i = 0; i < SERIAL_NUM_MAX_LEN; i++ )
+    {
+        c = ReadEeprom( SERIAL_NUM_ADDR + i );
+        if ( ( c < 0x20 ) || ( c > 0x7E ) )
+            break;
+        serial_dsc.string[i] = c;
+    }
+    serial_dsc.bLength  = 2 + 2 * i;
+    serial_dsc.bDscType = USB_DESCRIPTOR_STRING;
+}
+
 void ProcessEepromFlags(void)
 {
+    LoadSerialNumber();
+
+    // Set the TCK frequency stored in EEPROM, or use the fastest one if none was stored.
+    if(ReadEeprom(TCK_FREQ_CHECK_ADDR) == (BYTE)~ReadEeprom(TCK_FREQ_ADDR))
+        SetTckCode(ReadEeprom(TCK_FREQ_ADDR));
+    else
+        SetTckCode(TCK_CODE_12MHZ);
+
     if(ReadEeprom(FLASH_ENABLE_FLAG_ADDR) == ENABLE_FLASH)
     {
         // Enable flash access by FPGA by releasing flash chip-enable.
@@ -313,9 +883,9 @@ void UserInit( void )
     SSPSTATbits.CKE   = 1;      // Change the bit output to TDI on the falling clock edge. (TDI is sampled on rising clock edge.)
     SSPCON1bits.CKP   = 0;      // Make the clock's idle state be the low logic level (logic 0).
     SSPCON1bits.SSPM0 = 0;      // Set the SSP into SPI master mode with clock = Fosc/4 (fastest setting).
-    SSPCON1bits.SSPM1 = 0;      //    MUST STAY AT THIS SETTING BECAUSE WE ASSUME BYTE TRANSMISSION
-    SSPCON1bits.SSPM2 = 0;      //    TAKES 8 INSTRUCTION CYCLES IN THE TDI, TDO LOOPS BELOW!!!
-    SSPCON1bits.SSPM3 = 0;
+    SSPCON1bits.SSPM1 = 0;      //    THE FIXED-TIMING TDI, TDO LOOPS BELOW ASSUME BYTE TRANSMISSION TAKES
+    SSPCON1bits.SSPM2 = 0;      //    8 INSTRUCTION CYCLES!!! Slower TCK frequencies are set by MSSP_ON()
+    SSPCON1bits.SSPM3 = 0;      //    and use loops that wait for each byte to finish.
     #endif
 
     // Initialize interrupts.
@@ -336,40 +906,2467 @@ void UserInit( void )
         if(DONE == 1)
             break;
     }
-    FLSHDSBL_TRIS = OUTPUT_PIN; // Any FPGA configuration is done, so disable the flash.
+    FLSHDSBL_TRIS = OUTPUT_PIN; // Any FPGA configuration is done, so disable the flash.
+
+    // Process EEPROM flags only AFTER FPGA tries to config from flash.
+    ProcessEepromFlags();       // Process the non-volatile flags stored in EEPROM.
+
+    FPGACLK_ON();               // Give the FPGA a clock whether it is configured or not.
+}
+
+
+
+// This function is called when the device becomes initialized, which occurs after the host sends a
+// SET_CONFIGURATION (wValue not = 0) request.  This callback function should initialize the endpoints
+// for the device's usage according to the current configuration.
+void USBCBInitEP( void )
+{
+    // Enable the endpoint.
+    USBEnableEndpoint( USBGEN_EP_NUM, USB_OUT_ENABLED | USB_IN_ENABLED | USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP );
+#if USE_DATA_EP
+    // Enable the control endpoint and wait for a status command.
+    USBEnableEndpoint( USBCTRL_EP_NUM, USB_OUT_ENABLED | USB_IN_ENABLED | USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP );
+    CtrlInHandle  = 0;
+    CtrlOutHandle = USBGenRead( USBCTRL_EP_NUM, (BYTE *)&CtrlOutBuffer, USBGEN_EP_SIZE );
+#endif
+    // Now begin waiting for the first packets to be received from the host via this endpoint.
+    OutIndex = 0;
+    OutHandle[0] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[0], USBGEN_EP_SIZE );
+    OutHandle[1] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[1], USBGEN_EP_SIZE );
+#if USE_RX_RING
+    // Start with an empty receive ring.
+    rx_head    = rx_tail = rx_count = 0;
+    rx_stalled = FALSE;
+    rx_enabled = TRUE;
+#endif
+    rx_high_water = 0;
+    rx_full_cnt   = 0;
+    // Initialize the pointer to the buffer which will return data to the host via this endpoint.
+    InIndex = 0;
+    InPacket  = &InBuffer[0];
+    // Start out receiving commands in packets.
+    comm_mode = COMM_MODE_PACKET;
+    zlp_enabled = FALSE;
+    out_held  = FALSE;
+    out_left  = 0;
+    // Acknowledge commands and start with a clean status. Send every response immediately.
+    return_enabled = TRUE;
+    coalesce_ticks = 0;
+    in_fill        = 0;
+    cmd_status     = 0;
+    num_cmds_done  = 0;
+#if USE_EVENT_EP
+    // Enable the event endpoint, but don't send any events until the host asks for them.
+    USBEnableEndpoint( EVENT_EP_NUM, USB_IN_ENABLED | USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP );
+    EventHandle = 0;
+    event_head  = event_tail = 0;
+    event_mask  = 0;
+#endif
+}
+
+
+
+//
+// Return the serial number string descriptor in response to a GET_DESCRIPTOR request. The USB stack only knows
+// about the string descriptors in ROM, so it passes this request along. If the board has no serial number,
+// the request is left unhandled and the USB stack stalls it.
+//
+void ServiceSerialNumRequest( void )
+{
+    if ( ( SetupPkt.RequestType != USB_SETUP_TYPE_STANDARD_BITFIELD )
+         || ( SetupPkt.bRequest != USB_REQUEST_GET_DESCRIPTOR )
+         || ( SetupPkt.bDescriptorType != USB_DESCRIPTOR_STRING )
+         || ( SetupPkt.bDscIndex != USB_SERIAL_NUM_STRING_INDEX )
+         || ( serial_dsc.bLength <= 2U ) )
+        return;
+    USBEP0SendRAMPtr( (BYTE *)&serial_dsc, serial_dsc.bLength, USB_EP0_INCLUDE_ZERO );
+}
+
+
+
+//
+// Handle a housekeeping command sent as a vendor request on EP0 so it doesn't have to wait behind the JTAG traffic
+// on the bulk endpoint. The request number is the command code and wValue holds the command's parameter. Any
+// response has the same format as the response through the bulk endpoint. This is called from the USB interrupt.
+//
+void ServiceVendorRequest( void )
+{
+    DATA_PACKET *rsp = (DATA_PACKET *)vendor_rsp;
+    BYTE save_chs, save_adresh, save_adresl;
+
+    if ( SetupPkt.RequestType != USB_SETUP_TYPE_VENDOR_BITFIELD )
+        return;
+
+    rsp->cmd = SetupPkt.bRequest;
+    switch ( SetupPkt.bRequest )
+    {
+        case ID_BOARD_CMD:
+            blink_counter = 50;
+            USBEP0Transmit( USB_EP0_NO_DATA );
+            break;
+
+        case INFO_CMD:
+            memcpypgm2ram( ( void * )( vendor_rsp + 1 ), (const rom void *)&device_info, sizeof( DEVICE_INFO ) );
+            rsp->device_info.checksum = calc_checksum( (CHAR8 *)vendor_rsp, sizeof( DEVICE_INFO ) );
+            USBEP0SendRAMPtr( vendor_rsp, sizeof( DEVICE_INFO ) + 1, USB_EP0_INCLUDE_ZERO );
+            break;
+
+        case PROG_CMD:
+            PROGB = ( SetupPkt.wValue != 0U );
+            USBEP0Transmit( USB_EP0_NO_DATA );
+            break;
+
+        case FLASH_ONOFF_CMD:
+            if ( SetupPkt.wValue != 0U )
+                FLSHDSBL_TRIS = INPUT_PIN;  // Let the FPGA control the flash chip-select.
+            else
+            {
+                FLSHDSBL      = 1;          // Grab the flash chip-select and disable the flash.
+                FLSHDSBL_TRIS = OUTPUT_PIN;
+            }
+            USBEP0Transmit( USB_EP0_NO_DATA );
+            break;
+
+        case AIO0_ADC_CMD:
+        case AIO1_ADC_CMD:
+            if ( ADCON0bits.GO )
+                return;     // An ADC command from the bulk endpoint is using the ADC, so stall and let the host retry.
+            // Leave the ADC as it was in case an ADC command from the bulk endpoint was interrupted.
+            save_chs    = ADCON0bits.CHS;
+            save_adresh = ADRESH;
+            save_adresl = ADRESL;
+            ConvertAdc( SetupPkt.bRequest == AIO0_ADC_CMD ? 0x6 : 0xb );
+            rsp->adc_high  = ADRESH;
+            rsp->adc_low   = ADRESL;
+            ADCON0bits.CHS = save_chs;
+            ADRESH         = save_adresh;
+            ADRESL         = save_adresl;
+            USBEP0SendRAMPtr( vendor_rsp, 3, USB_EP0_INCLUDE_ZERO );
+            break;
+
+        default:
+            break;  // Unhandled requests are stalled by the USB stack.
+    } /* switch */
+}
+
+
+
+#if USE_DATA_EP
+//
+// Handle a command from the control endpoint. Only quick status commands are handled here and they are
+// answered even in the middle of a JTAG stream, so they can't touch the JTAG pins or the data endpoint buffers.
+//
+static void ServiceControl( void )
+{
+    BYTE num_return_bytes, i;
+
+    // Wait for a command, and for the previous response to be sent so its buffer can be reused.
+    if ( USBHandleBusy( CtrlOutHandle ) || USBHandleBusy( CtrlInHandle ) )
+        return;
+
+    num_return_bytes = 0;
+    CtrlInBuffer.cmd = CtrlOutBuffer.cmd;
+    switch ( CtrlOutBuffer.cmd )
+    {
+        case ID_BOARD_CMD:
+            blink_counter    = 50;
+            num_return_bytes = 1;
+            break;
+
+        case INFO_CMD:
+            memcpypgm2ram( ( void * )( (BYTE *)&CtrlInBuffer + 1 ), (const rom void *)&device_info, sizeof( DEVICE_INFO ) );
+            CtrlInBuffer.device_info.checksum = calc_checksum( (CHAR8 *)&CtrlInBuffer, sizeof( DEVICE_INFO ) );
+            num_return_bytes = sizeof( DEVICE_INFO ) + 1;
+            break;
+
+        case SYNC_CMD:
+            // Only report the status here. It is cleared by the SYNC_CMD in the command stream, so a status
+            // check on this endpoint in the middle of the stream doesn't hide errors from that sync.
+            CtrlInBuffer.status   = cmd_status;
+            CtrlInBuffer.num_cmds = num_cmds_done;
+            num_return_bytes      = 4;
+            break;
+
+        case AIO0_ADC_CMD:
+        case AIO1_ADC_CMD:
+            ConvertAdc( CtrlOutBuffer.cmd == AIO0_ADC_CMD ? 0x6 : 0xb );
+            CtrlInBuffer.adc_high = ADRESH;
+            CtrlInBuffer.adc_low  = ADRESL;
+            num_return_bytes      = 3;
+            break;
+
+        case READ_EEDATA_CMD:
+            if ( CtrlOutBuffer.len > USBGEN_EP_SIZE - 5 )
+                CtrlOutBuffer.len = USBGEN_EP_SIZE - 5;
+            for ( i = 0; i < CtrlOutBuffer.len; i++ )
+                CtrlInBuffer.data[i] = ReadEeprom( (BYTE)CtrlOutBuffer.ADR.pAdr + i );
+            num_return_bytes = i + 5;
+            break;
+
+        default:
+            cmd_status |= STATUS_BAD_CMD;
+            break;
+    } /* switch */
+
+    CtrlOutHandle = USBGenRead( USBCTRL_EP_NUM, (BYTE *)&CtrlOutBuffer, USBGEN_EP_SIZE );
+    if ( num_return_bytes != 0U )
+        CtrlInHandle = USBGenWrite( USBCTRL_EP_NUM, (BYTE *)&CtrlInBuffer, num_return_bytes );
+}
+#endif
+
+
+
+#if USE_EVENT_EP
+//
+// Add an event to the queue of events waiting to be sent to the host.
+//
+static void PostEvent( BYTE type, BYTE arg, WORD value )
+{
+    BYTE next = ( event_head + 1 ) & ( EVENT_QUEUE_LEN - 1 );
+
+    if ( next == event_tail )
+    {
+        cmd_status |= STATUS_EVENT_LOST;    // The queue is full, so the event is dropped.
+        return;
+    }
+    event_queue[event_head].type  = type;
+    event_queue[event_head].arg   = arg;
+    event_queue[event_head].value = value;
+    event_head = next;
+}
+
+
+
+//
+// Look for changes of the DONE pin and the ADC reading, and send any events that are waiting.
+//
+static void ServiceEvents( void )
+{
+    BYTE i;
+    WORD adc;
+
+    if ( ( event_mask & EVENT_MASK_DONE ) && ( DONE != last_done ) )
+    {
+        last_done = DONE;
+        PostEvent( last_done ? EVENT_DONE_RISE : EVENT_DONE_FALL, 0, num_cmds_done );
+    }
+
+    // Read the ADC once every tick of the runtest timer and report when it goes past one of the limits.
+    if ( ( event_mask & EVENT_MASK_ADC ) && ( adc_tick != GetRuntestTimer() ) && !ADCON0bits.GO )
+    {
+        adc_tick = GetRuntestTimer();
+        ConvertAdc( event_adc_chan );
+        adc = ( (WORD)ADRESH << 8 ) | ADRESL;
+        if ( adc > event_adc_high )
+        {
+            if ( adc_level != ADC_ABOVE )
+                PostEvent( EVENT_ADC_HIGH, event_adc_chan, adc );
+            adc_level = ADC_ABOVE;
+        }
+        else if ( adc < event_adc_low )
+        {
+            if ( adc_level != ADC_BELOW )
+                PostEvent( EVENT_ADC_LOW, event_adc_chan, adc );
+            adc_level = ADC_BELOW;
+        }
+        else
+            adc_level = ADC_BETWEEN;
+    }
+
+    // Send as many waiting events as fit in a packet once the previous packet is gone.
+    if ( ( event_head == event_tail ) || USBHandleBusy( EventHandle ) )
+        return;
+    for ( i = 0; ( i < EVENT_EP_SIZE / sizeof( EVENT ) ) && ( event_tail != event_head ); i++ )
+    {
+        EventBuffer[i] = event_queue[event_tail];
+        event_tail     = ( event_tail + 1 ) & ( EVENT_QUEUE_LEN - 1 );
+    }
+    EventHandle = USBGenWrite( EVENT_EP_NUM, (BYTE *)EventBuffer, i * sizeof( EVENT ) );
+}
+#endif
+
+
+
+void ProcessIO( void )
+{
+    if ( ( USBGetDeviceState() < CONFIGURED_STATE ) || USBIsDeviceSuspended() )
+        return;
+
+    SERVICE_CTRL();
+    SERVICE_EVENTS();
+    ServiceRequests();
+}
+
+
+
+//
+// CRC32 remainders for each nibble, followed by the same remainders shifted right by four bits. Two nibble
+// steps fold into one byte step with a lookup in each half, and the tables take 128 bytes of flash instead
+// of the 1 KB of a byte table. The tables are at the start of a page so the lookups only have to set TBLPTRL.
+//
+#pragma romdata crc32_section=0x3E00
+static const rom DWORD crc32_nibble[32] = {
+    0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL, 0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+    0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL, 0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL,
+    0x00000000UL, 0x01DB7106UL, 0x03B6E20CUL, 0x026D930AUL, 0x076DC419UL, 0x06B6B51FUL, 0x04DB2615UL, 0x05005713UL,
+    0x0EDB8832UL, 0x0F00F934UL, 0x0D6D6A3EUL, 0x0CB61B38UL, 0x09B64C2BUL, 0x086D3D2DUL, 0x0A00AE27UL, 0x0BDBDF21UL,
+};
+#pragma romdata
+
+
+
+//
+// Fold a buffer of TDO bytes into the CRC. With x = (low byte of the CRC) ^ (TDO byte), the two nibble steps
+// come to CRC = (CRC >> 8) ^ (table[x & 0x0F] >> 4) ^ table[((x >> 4) ^ table[x & 0x0F]) & 0x0F], which the
+// loop below does with byte moves on a copy of the CRC in access RAM. Each byte takes 54 instruction cycles
+// (4.5 us), so a 64-byte packet of TDO adds about 0.3 ms.
+//
+static void CrcTdoBytes( BYTE *p, BYTE n )
+{
+    BYTE *crc;
+
+    if ( n == 0U )
+        return;
+
+    crc         = (BYTE *)&tdo_crc;
+    crc_b0      = crc[0];
+    crc_b1      = crc[1];
+    crc_b2      = crc[2];
+    crc_b3      = crc[3];
+    buffer_cntr = n;
+    save_FSR0   = FSR0;
+    TBLPTR      = (UINT24)crc32_nibble;
+    FSR0        = (WORD)p;
+    _asm
+CRC_BYTE_LOOP:
+    MOVF POSTINC0, 0, ACCESS                // Get the next TDO byte and XOR it with the low byte of the CRC.
+    XORWF crc_b0, 0, ACCESS
+    MOVWF crc_x, ACCESS
+    ANDLW 0x0F                              // Point to the remainder for the low nibble.
+    MULLW 4
+    MOVFF PRODL, TBLPTRL
+    TBLRD                                   // The low byte of the remainder picks the remainder for the high nibble.
+    SWAPF crc_x, 0, ACCESS
+    XORWF TABLAT, 0, ACCESS
+    ANDLW 0x0F
+    BSF TBLPTRL, 6, ACCESS                  // Point to the shifted remainder for the low nibble.
+    MULLW 4                                 // (PRODL now indexes the remainder for the high nibble.)
+    TBLRDPOSTINC                            // Shift the CRC right one byte and XOR the shifted remainder into it.
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b1, 0, ACCESS
+    MOVWF crc_b0, ACCESS
+    TBLRDPOSTINC
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b2, 0, ACCESS
+    MOVWF crc_b1, ACCESS
+    TBLRDPOSTINC
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b3, 0, ACCESS
+    MOVWF crc_b2, ACCESS
+    TBLRD
+    MOVFF TABLAT, crc_b3
+    MOVFF PRODL, TBLPTRL                    // XOR the remainder for the high nibble into the CRC.
+    TBLRDPOSTINC
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b0, 1, ACCESS
+    TBLRDPOSTINC
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b1, 1, ACCESS
+    TBLRDPOSTINC
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b2, 1, ACCESS
+    TBLRD
+    MOVF TABLAT, 0, ACCESS
+    XORWF crc_b3, 1, ACCESS
+    DECFSZ buffer_cntr, 1, ACCESS
+    BRA CRC_BYTE_LOOP
+    _endasm
+    FSR0   = save_FSR0;
+    crc[0] = crc_b0;
+    crc[1] = crc_b1;
+    crc[2] = crc_b2;
+    crc[3] = crc_b3;
+}
+
+
+
+//
+// Start capturing the TDO bits in the windows (if any are set) for the current command.
+//
+static void StartTdoWindows( BYTE flags )
+{
+    BYTE i;
+
+    if ( num_windows == 0U )
+        return;
+    win_tdo       = TRUE;
+    win_msb_first = ( ( flags & RAW_ORDER_MASK ) != 0U );
+    win_bit       = 0;
+    win_index     = 0;
+    win_next      = win_start[0];
+    win_left      = win_len[0];
+    win_fill      = 0;
+    for ( i = 0; i < TDO_WIN_BYTES; i++ )
+        win_buf[i] = 0;
+}
+
+
+
+//
+// Pick the TDO bits that fall in the windows out of a buffer of TDO bytes and pack them into the window buffer.
+// Only the first last_bits bits of the final byte were captured, so the rest of it isn't counted.
+//
+static void WindowTdoBits( BYTE *p, BYTE n, BYTE last_bits )
+{
+    BYTE i, num_bits;
+
+    for ( ; n != 0U; n--, p++, win_bit += num_bits )
+    {
+        num_bits = ( n == 1U ) ? last_bits : 8;
+        // Capture the bits of the windows that fall in this byte.
+        while ( ( win_left != 0U ) && ( win_next < win_bit + num_bits ) )
+        {
+            i = (BYTE)( win_next - win_bit );
+            if ( *p & ( win_msb_first ? ( 0x80 >> i ) : ( 0x01 << i ) ) )
+                win_buf[win_fill >> 3] |= 0x01 << ( win_fill & 0x7 );
+            win_fill++;
+            win_next++;
+            if ( ( --win_left == 0U ) && ( ++win_index < num_windows ) )
+            {
+                win_next = win_start[win_index];
+                win_left = win_len[win_index];
+            }
+        }
+    }
+}
+
+
+
+//
+// Fold TDO bytes into the CRC or pick out the bits in the windows instead of returning them.
+//
+static void TakeTdoBytes( BYTE *p, BYTE n )
+{
+    if ( crc_tdo )
+        CrcTdoBytes( p, n );
+    else
+        WindowTdoBits( p, n, 8 );
+}
+
+
+
+//
+// Start gathering the TDO bits of a JTAG_CMD or scan. They may go through the windows or be compressed.
+//
+static void StartTdoCapture( BYTE flags )
+{
+    StartTdoWindows( flags );
+    #if USE_TDO_RLE
+    rle_tdo     = tdo_rle_enabled && !win_tdo;
+    rle_fill    = 0;
+    rle_run_len = 0;
+    #endif
+}
+
+
+
+#if USE_TDO_RLE
+//
+// Add a byte to the open literal of compressed TDO bytes, or start a new literal if there isn't one or it's full.
+//
+static void RleLiteral( BYTE b )
+{
+    if ( ( rle_lit == NO_RLE_LIT ) || ( rle_buf[rle_lit] == TDO_RLE_MAX_LIT - 1 ) )
+    {
+        rle_lit = rle_len;
+        rle_buf[rle_len++] = 0xFF;  // The code is one less than the number of bytes, so it goes to 0 with the first byte.
+    }
+    rle_buf[rle_len++] = b;
+    rle_buf[rle_lit]++;
+}
+
+
+
+//
+// Add the pending run of 0x00 or 0xFF bytes to the compressed TDO bytes. A short run costs less as part of a literal.
+//
+static void RleEndRun( void )
+{
+    if ( rle_run_len == 0U )
+        return;
+    if ( ( rle_run_len == 1U ) || ( ( rle_run_len == 2U ) && ( rle_lit != NO_RLE_LIT ) ) )
+    {
+        for ( ; rle_run_len != 0U; rle_run_len-- )
+            RleLiteral( rle_run_byte );
+        return;
+    }
+    rle_buf[rle_len++] = TDI_RLE_RUN_MASK | ( rle_run_byte ? TDI_RLE_ONES_MASK : 0 ) | (BYTE)( ( rle_run_len - 1 ) >> 8 );
+    rle_buf[rle_len++] = (BYTE)( rle_run_len - 1 );
+    rle_run_len = 0;
+    rle_lit     = NO_RLE_LIT;     // The next literal byte has to start a new literal.
+}
+
+
+
+//
+// Compress a buffer of TDO bytes into rle_buf. A run can continue into the next buffer, but a literal can't.
+//
+static void RleTdoBytes( BYTE *p, BYTE n )
+{
+    BYTE b;
+
+    rle_len = 0;
+    rle_lit = NO_RLE_LIT;
+    for ( ; n != 0U; n--, p++ )
+    {
+        b = *p;
+        if ( rle_run_len != 0U )
+        {
+            if ( ( b == rle_run_byte ) && ( rle_run_len < TDO_RLE_MAX_RUN ) )
+            {
+                rle_run_len++;
+                continue;
+            }
+            RleEndRun();
+        }
+        if ( ( b == 0x00 ) || ( b == 0xFF ) )
+        {
+            rle_run_byte = b;
+            rle_run_len  = 1;
+        }
+        else
+            RleLiteral( b );
+    }
+}
+#endif
+
+
+
+//
+// Send the TDO bits collected in the current IN packet to the host and get the next IN packet ready.
+//
+static void WriteTdoPacket( void )
+{
+    last_in_full      = ( tdo == (BYTE *)InPacket + USBGEN_EP_SIZE );
+    InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)InPacket, tdo - (BYTE *)InPacket );
+    // TDO bits have now been queued for transmission, so move pointer to next ping-pong buffer.
+    InIndex ^= IN_INDEX_TOGGLE;
+    // Wait until previous packet of TDO bits has been transmitted so we don't overwrite it.
+    while ( USBHandleBusy( InHandle[InIndex] ) )
+        SERVICE_WAIT();               // Wait until USB transmitter is not busy.
+    InPacket = &InBuffer[InIndex];
+    tdo      = (BYTE *)InPacket;
+}
+
+
+
+#if USE_TDO_RLE
+//
+// Compress the raw TDO bytes that follow the compressed ones at the start of the IN packet. Only full packets
+// of compressed bytes are sent, and any left over start the next packet. The pending run is added at the end.
+//
+static void PackRleTdo( BOOL last )
+{
+    BYTE i;
+
+    RleTdoBytes( (BYTE *)InPacket + rle_fill, tdo - ( (BYTE *)InPacket + rle_fill ) );
+    if ( last )
+        RleEndRun();
+    tdo = (BYTE *)InPacket + rle_fill;
+    for ( i = 0; i < rle_len; i++ )
+    {
+        if ( tdo == (BYTE *)InPacket + USBGEN_EP_SIZE )
+            WriteTdoPacket();
+        *tdo++ = rle_buf[i];
+    }
+    if ( tdo == (BYTE *)InPacket + USBGEN_EP_SIZE )
+        WriteTdoPacket();
+    rle_fill = tdo - (BYTE *)InPacket;
+}
+#endif
+
+
+
+//
+// Send the TDO bits collected in the current IN packet to the host and get the next IN packet ready.
+// (If the TDO bits are going into a CRC or through windows, they are taken from the packet and it is reused.
+// Compressed TDO bits, and all TDO bits when responses end with a ZLP, are only sent once they fill a packet
+// so that only the last packet of the response is short.)
+//
+static void SendTdoPacket( void )
+{
+    if ( crc_tdo || win_tdo )
+    {
+        TakeTdoBytes( (BYTE *)InPacket, tdo - (BYTE *)InPacket );
+        tdo = (BYTE *)InPacket;
+        return;
+    }
+    #if USE_TDO_RLE
+    if ( rle_tdo )
+    {
+        PackRleTdo( FALSE );
+        return;
+    }
+    #endif
+    if ( zlp_enabled && ( tdo != (BYTE *)InPacket + USBGEN_EP_SIZE ) )
+        return;     // Keep filling the packet. The response sends it once it's done.
+    WriteTdoPacket();
+}
+
+
+
+//
+// Send the small responses collected in the current IN packet to the host and get the next IN packet ready.
+// (A full packet is followed by a zero-length packet when responses end with a ZLP, the same as the other responses.)
+//
+static void FlushInPacket( void )
+{
+    if ( in_fill == 0U )
+        return;
+    InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)&InBuffer[InIndex], in_fill );
+    InIndex ^= IN_INDEX_TOGGLE;
+    while ( USBHandleBusy( InHandle[InIndex] ) )
+        SERVICE_WAIT();               // Wait until USB transmitter is not busy.
+    if ( zlp_enabled && ( in_fill == USBGEN_EP_SIZE ) )
+    {
+        InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)&InBuffer[InIndex], 0 );
+        InIndex ^= IN_INDEX_TOGGLE;
+        while ( USBHandleBusy( InHandle[InIndex] ) )
+            SERVICE_WAIT();           // Wait until USB transmitter is not busy.
+    }
+    InPacket = &InBuffer[InIndex];
+    in_fill  = 0;
+}
+
+
+
+#if USE_RX_RING
+//
+// Move the packets received in the endpoint buffers into the receive ring and re-arm the endpoint buffers.
+// This is called from the USB interrupt when any transfer finishes (IN transfers too), so a packet that is
+// waiting for room in the ring is only counted the first time.
+//
+void FillRxRing( void )
+{
+    BYTE *src, *dst;
+    WORD save_fsr0, save_fsr1;
+    BYTE save_giel;
+
+    if ( !rx_enabled )
+        return;
+
+    while ( !USBHandleBusy( OutHandle[OutIndex] ) )
+    {
+        if ( rx_count == RX_RING_LEN )
+        {
+            // Leave the packet in the endpoint buffer until there's room in the ring.
+            if ( !rx_stalled )
+                rx_full_cnt++;
+            rx_stalled = TRUE;
+            return;
+        }
+        rx_stalled   = FALSE;
+        rx_copy_cntr = USBHandleGetLength( OutHandle[OutIndex] );
+        rx_len[rx_head] = rx_copy_cntr;
+        if ( rx_copy_cntr != 0U )
+        {
+            // Copy the packet at five cycles per byte since this is usually in the interrupt. FSR1 is the C stack
+            // pointer, so nothing can be called until it is restored. That includes the timer interrupt, which
+            // would push its context into the ring (this also runs from the main loop with only USB masked).
+            src       = (BYTE *)&OutBuffer[OutIndex];
+            dst       = (BYTE *)&RxRing[rx_head];
+            save_giel = INTCONbits.GIEL;    // (This may interrupt GetRuntestTimer() while it has GIEL cleared.)
+            INTCONbits.GIEL = 0;
+            save_fsr0 = FSR0;
+            save_fsr1 = FSR1;
+            FSR0      = (WORD)src;
+            FSR1      = (WORD)dst;
+            _asm
+RX_COPY_LOOP:
+            MOVFF POSTINC0, POSTINC1
+            DECFSZ rx_copy_cntr, 1, ACCESS
+            BRA RX_COPY_LOOP
+            _endasm
+            FSR1      = save_fsr1;
+            FSR0      = save_fsr0;
+            INTCONbits.GIEL = save_giel;
+        }
+        OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE );
+        OutIndex ^= 1; // Point to next ping-pong buffer.
+        rx_head = ( rx_head + 1 ) & ( RX_RING_LEN - 1 );
+        rx_count++;
+        if ( rx_count > rx_high_water )
+            rx_high_water = rx_count;
+    }
+}
+
+
+
+//
+// Release the packet at the tail of the receive ring and fill the room it leaves.
+//
+static void ReleaseRxPacket( void )
+{
+    USBMaskInterrupts();
+    rx_tail = ( rx_tail + 1 ) & ( RX_RING_LEN - 1 );
+    rx_count--;
+    FillRxRing();   // A packet may be waiting in an endpoint buffer for room in the ring.
+    USBUnmaskInterrupts();
+}
+#endif
+
+
+
+//
+// Release the current OUT packet and wait for the next packet of TMS and/or TDI bits to arrive.
+//
+static void GetOutPacket( void )
+{
+    // This packet has been handled, so get another.
+    OUT_RELEASE();
+
+    // Wait until the next packet of TMS and/or TDI bits arrives.
+    while ( OUT_BUSY() )
+        SERVICE_WAIT();
+    // (OutPacket is left pointing at the command that is being processed.)
+    tms_tdi  = (BYTE *)OUT_BUFFER();
+    out_left = OUT_LENGTH();
+}
+
+
+
+//
+// Get the next packet of TMS and/or TDI bits. Any TDO bits that were collected are sent back first.
+//
+static void NextOutPacket( BYTE flags )
+{
+    if ( ( flags & GET_TDO_MASK ) && ( tdo != (BYTE *)InPacket ) )
+        SendTdoPacket();
+    GetOutPacket();
+}
+
+
+
+//
+// Get the next byte received from the host, moving on to the next packet when the current one runs out.
+//
+static BYTE GetOutByte( BYTE flags )
+{
+    while ( out_left == 0U )
+        NextOutPacket( flags );
+    out_left--;
+    return *tms_tdi++;
+}
+
+
+
+//
+// Load the next run of constant TMS bits for a JTAG_CMD with run-length-encoded TMS and set the TMS pin
+// to its level. TMS stays at the level of the final run once the list of runs is used up.
+//
+static void LoadTmsRun( void )
+{
+    WORD tms_run;
+
+    if ( tms_run_index < num_tms_runs )
+    {
+        tms_run      = tms_runs[tms_run_index++];
+        tms_run_left = tms_run & TMS_RUN_LEN_MASK;
+        TMS          = ( tms_run & TMS_RUN_LEVEL_MASK ) ? 1 : 0;
+    }
+    else
+    {
+        tms_run_left = TMS_RUN_LEN_MASK;
+    }
+}
+
+
+
+//
+// Copy the list of TMS runs that follows the header of a JTAG_CMD packet and move past it. The list is read
+// through GetOutByte() so it can run into the next packet. Return false if there are more runs than can be kept.
+//
+static BOOL GetTmsRuns( void )
+{
+    BYTE i;
+    WORD run;
+
+    num_tms_runs = GetOutByte( 0 );
+    for ( i = 0; i < num_tms_runs; i++ )
+    {
+        run = GetOutByte( 0 );
+        run |= (WORD)GetOutByte( 0 ) << 8;
+        if ( i < MAX_TMS_RUNS )
+            tms_runs[i] = run;
+    }
+    tms_run_index = 0;
+    tms_run_left  = 0;
+    return num_tms_runs <= MAX_TMS_RUNS;
+}
+
+
+
+//
+// Shift whole bytes of bits through the JTAG port. Each byte holds eight TMS and/or TDI bits
+// (a TMS byte precedes its TDI byte if both are present) that are taken from tms_tdi, and the
+// TDO bits collected while they are sent are stored at tdo.  Both pointers are advanced past the
+// bytes that were processed.  The bits within each byte are sent LSB-first (MSB-first in the raw
+// bit-order loops, which skip the bit-order table).  There is a separate
+// loop for each combination of TMS, TDI and TDO bits so no flags are tested while the bits
+// are being shifted.  (The MSSP must already be enabled if TMS bits are not being sent.)
+//
+static void ShiftJtagBytes( BYTE flags, BYTE num_bytes )
+{
+    if ( num_bytes == 0U )
+        return;
+
+    buffer_cntr = num_bytes;
+    save_FSR0   = FSR0;
+    save_FSR1   = FSR1;
+    TBLPTR      = (UINT24)reverse_bits; // Setup the pointer to the bit-order table.
+    FSR0        = (WORD)tms_tdi;
+    FSR1        = (WORD)tdo;
+
+    switch ( flags )
+    {
+        #if USE_MSSP
+        case GET_TDO_MASK:  // Just gather TDO bits.
+            _asm
+            MOVLW   0                           // Load the SPI transmitter with 0's
+            MOVWF SSPBUF, ACCESS                //   so TDI is cleared while TDO is collected.
+            NOP                                 // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+PRI_TAP_LOOP_2:
+            NOP
+            NOP
+            DCFSNZ buffer_cntr, 1, ACCESS
+            BRA PRI_TAP_LOOP_3
+            MOVFF SSPBUF, TBLPTRL               // Get the TDO byte that was received and use it to index into the bit-order table.
+            MOVWF SSPBUF, ACCESS
+            TBLRD                               // TABLAT now contains the TDO byte in the proper bit-order.
+            MOVFF TABLAT, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            BRA PRI_TAP_LOOP_2
+PRI_TAP_LOOP_3:
+            MOVFF SSPBUF, TBLPTRL               // Get the TDO byte that was received and use it to index into the bit-order table.
+            TBLRD                               // TABLAT now contains the TDO byte in the proper bit-order.
+            MOVFF TABLAT, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            _endasm
+            break;
+
+        case PUT_TDI_MASK:  // Just output the TDI bits.
+            _asm
+            MOVFF POSTINC0, TBLPTRL             // Get the current TDI byte and use it to index into the bit-order table.
+            TBLRD                               // TABLAT now contains the TDI byte in the proper bit-order.
+            MOVFF TABLAT, SSPBUF                // Load TDI byte into SPI transmitter.
+            NOP
+            NOP
+PRI_TAP_LOOP_0:
+            DCFSNZ buffer_cntr, 1, ACCESS       // Decrement the buffer counter and continue if not zero
+            BRA PRI_TAP_LOOP_1
+            MOVFF POSTINC0, TBLPTRL             // Get the current TDI byte and use it to index into the bit-order table.
+            TBLRD                               // TABLAT now contains the TDI byte in the proper bit-order.
+            MOVFF SSPBUF, TBLPTRL               // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
+            MOVFF TABLAT, SSPBUF                // Load TDI byte into SPI transmitter ASAP.
+            BRA PRI_TAP_LOOP_0
+PRI_TAP_LOOP_1:
+            NOP
+            NOP
+            NOP
+            MOVFF SSPBUF, TBLPTRL               // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
+            _endasm
+            break;
+
+        case PUT_TDI_MASK | GET_TDO_MASK:  // Output TDI bits while gathering TDO bits.
+            _asm
+PRI_TAP_LOOP_4:
+            MOVFF POSTINC0, TBLPTRL             // Get the current TDI byte and use it to index into the bit-order table.
+            TBLRD                               // TABLAT now contains the TDI byte in the proper bit-order.
+            MOVFF TABLAT, SSPBUF                // Load TDI byte into SPI transmitter.
+            NOP                                 // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            MOVFF SSPBUF, TBLPTRL               // Get the TDO byte that was received and use it to index into the bit-order table.
+            TBLRD                               // TABLAT now contains the TDO byte in the proper bit-order.
+            MOVFF TABLAT, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the buffer counter and continue
+            BRA PRI_TAP_LOOP_4                  //   processing TDI bytes until it is 0.
+            _endasm
+            break;
+
+        // The bytes are already in MSB-first order for these loops, so the bit-order table isn't needed.
+        case GET_TDO_MASK | RAW_ORDER_MASK:  // Just gather TDO bits.
+            _asm
+            MOVLW   0                           // Load the SPI transmitter with 0's
+            MOVWF SSPBUF, ACCESS                //   so TDI is cleared while TDO is collected.
+            NOP                                 // Make up for the BRA of the loop on the first byte.
+            NOP
+PRI_RAW_LOOP_0:
+            NOP                                 // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            DCFSNZ buffer_cntr, 1, ACCESS       // (10 cycles from the write to the read, 13 cycles per byte.)
+            BRA PRI_RAW_LOOP_1
+            MOVFF SSPBUF, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            MOVWF SSPBUF, ACCESS
+            BRA PRI_RAW_LOOP_0
+PRI_RAW_LOOP_1:
+            MOVFF SSPBUF, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            _endasm
+            break;
+
+        case PUT_TDI_MASK | RAW_ORDER_MASK:  // Just output the TDI bits.
+            _asm
+PRI_RAW_LOOP_2:
+            MOVF SSPBUF, 0, ACCESS              // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
+            MOVFF POSTINC0, SSPBUF              // Load TDI byte into SPI transmitter.
+            NOP                                 // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the buffer counter and continue
+            BRA PRI_RAW_LOOP_2                  //   processing TDI bytes until it is 0. (13 cycles per byte.)
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            MOVF SSPBUF, 0, ACCESS              // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
+            _endasm
+            break;
+
+        case PUT_TDI_MASK | GET_TDO_MASK | RAW_ORDER_MASK:  // Output TDI bits while gathering TDO bits.
+            _asm
+            MOVFF POSTINC0, SSPBUF              // Load TDI byte into SPI transmitter.
+            NOP                                 // Make up for the BRA of the loop on the first byte.
+            NOP
+PRI_RAW_LOOP_3:
+            NOP                                 // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
+            NOP
+            NOP
+            NOP
+            NOP
+            NOP
+            DCFSNZ buffer_cntr, 1, ACCESS       // (10 cycles from the write to the read, 14 cycles per byte.)
+            BRA PRI_RAW_LOOP_4
+            MOVFF SSPBUF, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            MOVFF POSTINC0, SSPBUF              // Load the next TDI byte into SPI transmitter ASAP.
+            BRA PRI_RAW_LOOP_3
+PRI_RAW_LOOP_4:
+            MOVFF SSPBUF, POSTINC1              // Store the TDO byte into the buffer and inc. the pointer.
+            _endasm
+            break;
+
+        #else
+        case GET_TDO_MASK:  // Just gather TDO bits.
+            _asm
+JTAG_TDO_LOOP:
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            BCF CARRY_BIT_ASM                   // Set carry to value on TDO pin of JTAG device.
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS            // Rotate TDO value into the MSbit of the TDO byte.
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            BSF TCK_ASM
+            BCF TCK_ASM
+            MOVFF tdo_bits, POSTINC1            // Store the TDO byte into the buffer and inc. the pointer.
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TDO_LOOP                   //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        case PUT_TDI_MASK:  // Just output the TDI bits.
+            _asm
+JTAG_TDI_LOOP:
+            MOVFF POSTINC0, tdi_bits            // Get the next byte of TDI bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            RRCF tdi_bits, 1, ACCESS            // Rotate the LSbit of the TDI byte into carry.
+            BSF TDI_ASM                         // Set TDI pin of JTAG device to value of TDI bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TDI_LOOP                   //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        case PUT_TDI_MASK | GET_TDO_MASK:  // Output TDI bits while gathering TDO bits.
+            _asm
+JTAG_TDI_TDO_LOOP:
+            MOVFF POSTINC0, tdi_bits            // Get the next byte of TDI bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            BCF CARRY_BIT_ASM                   // Set carry to value on TDO pin of JTAG device.
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS            // Rotate TDO value into the MSbit of the TDO byte.
+            RRCF tdi_bits, 1, ACCESS            // Rotate the LSbit of the TDI byte into carry.
+            BSF TDI_ASM                         // Set TDI pin of JTAG device to value of TDI bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            MOVFF tdo_bits, POSTINC1            // Store the TDO byte into the buffer and inc. the pointer.
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TDI_TDO_LOOP               //   processing bytes until it is 0.
+            _endasm
+            break;
+        #endif
+
+        // There is no way to send TMS bits with the MSSP so they are always bit-banged.
+        case PUT_TMS_MASK:  // Just output the TMS bits.
+            _asm
+JTAG_TMS_LOOP:
+            MOVFF POSTINC0, tms_bits            // Get the next byte of TMS bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            RRCF tms_bits, 1, ACCESS            // Rotate the LSbit of the TMS byte into carry.
+            BSF TMS_ASM                         // Set TMS pin of JTAG device to value of TMS bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TMS_LOOP                   //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        case PUT_TMS_MASK | GET_TDO_MASK:  // Output TMS bits while gathering TDO bits.
+            _asm
+JTAG_TMS_TDO_LOOP:
+            MOVFF POSTINC0, tms_bits            // Get the next byte of TMS bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            BCF CARRY_BIT_ASM                   // Set carry to value on TDO pin of JTAG device.
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS            // Rotate TDO value into the MSbit of the TDO byte.
+            RRCF tms_bits, 1, ACCESS            // Rotate the LSbit of the TMS byte into carry.
+            BSF TMS_ASM                         // Set TMS pin of JTAG device to value of TMS bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            MOVFF tdo_bits, POSTINC1            // Store the TDO byte into the buffer and inc. the pointer.
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TMS_TDO_LOOP               //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        case PUT_TMS_MASK | PUT_TDI_MASK:  // Output TMS and TDI bits.
+            _asm
+JTAG_TMS_TDI_LOOP:
+            MOVFF POSTINC0, tms_bits            // Get the next byte of TMS bits.
+            MOVFF POSTINC0, tdi_bits            // Get the next byte of TDI bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            RRCF tms_bits, 1, ACCESS            // Rotate the LSbit of the TMS byte into carry.
+            BSF TMS_ASM                         // Set TMS pin of JTAG device to value of TMS bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS            // Rotate the LSbit of the TDI byte into carry.
+            BSF TDI_ASM                         // Set TDI pin of JTAG device to value of TDI bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TMS_TDI_LOOP               //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        case PUT_TMS_MASK | PUT_TDI_MASK | GET_TDO_MASK:  // Output TMS and TDI bits while gathering TDO bits.
+            _asm
+JTAG_TMS_TDI_TDO_LOOP:
+            MOVFF POSTINC0, tms_bits            // Get the next byte of TMS bits.
+            MOVFF POSTINC0, tdi_bits            // Get the next byte of TDI bits.
+            // Bit 0 of a byte of TMS/TDI/TDO bits.
+            BCF CARRY_BIT_ASM                   // Set carry to value on TDO pin of JTAG device.
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS            // Rotate TDO value into the MSbit of the TDO byte.
+            RRCF tms_bits, 1, ACCESS            // Rotate the LSbit of the TMS byte into carry.
+            BSF TMS_ASM                         // Set TMS pin of JTAG device to value of TMS bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS            // Rotate the LSbit of the TDI byte into carry.
+            BSF TDI_ASM                         // Set TDI pin of JTAG device to value of TDI bit.
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM                         // Toggle TCK pin of JTAG device.
+            BCF TCK_ASM
+            // Bit 1
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 2
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 3
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 4
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 5
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 6
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            // Bit 7
+            BCF CARRY_BIT_ASM
+            BTFSC TDO_ASM
+            BSF CARRY_BIT_ASM
+            RRCF tdo_bits, 1, ACCESS
+            RRCF tms_bits, 1, ACCESS
+            BSF TMS_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TMS_ASM
+            RRCF tdi_bits, 1, ACCESS
+            BSF TDI_ASM
+            BTFSS CARRY_BIT_ASM
+            BCF TDI_ASM
+            BSF TCK_ASM
+            BCF TCK_ASM
+            MOVFF tdo_bits, POSTINC1            // Store the TDO byte into the buffer and inc. the pointer.
+            DECFSZ buffer_cntr, 1, ACCESS       // Decrement the byte counter and continue
+            BRA JTAG_TMS_TDI_TDO_LOOP           //   processing bytes until it is 0.
+            _endasm
+            break;
+
+        default:
+            // No TMS, TDI or TDO bits to handle so do nothing.
+            break;
+    } /* switch */
+
+    TCK     = 0;
+    out_left -= (BYTE *)FSR0 - tms_tdi;
+    tms_tdi = (BYTE *)FSR0; // Move the pointers past the bytes that were processed.
+    tdo     = (BYTE *)FSR1;
+    FSR1    = save_FSR1;
+    FSR0    = save_FSR0;
+} /* ShiftJtagBytes */
+
+
+
+#if USE_MSSP
+//
+// Wait until the MSSP has finished shifting the byte in SSPBUF. The caller reads SSPBUF to clear the buffer-full flag.
+//
+static void WaitMsspByte( void )
+{
+    _asm
+WAIT_MSSP_LOOP:
+    MOVF SSPSTAT, TO_WREG, ACCESS           // Wait for the byte to be transmitted.
+    BTFSS MSSP_BF_ASM                       // (Can't check SSPSTAT directly or else the transfer doesn't work.)
+    BRA WAIT_MSSP_LOOP
+    _endasm
+}
+#endif
+
+
+
+//
+// Shift up to eight bits through the JTAG port. This works like ShiftJtagBytes() except the
+// bits are bit-banged one at a time so it is used for the partial byte at the end of a scan.
+//
+static void ShiftJtagBits( BYTE flags, BYTE num_bits )
+{
+    BYTE bit_mask;                  // Mask to select bit from a byte.
+    BYTE tms_byte, tdi_byte, tdo_byte;      // Temporary bytes of TMS, TDI and TDO bits.
+
+    if( flags & PUT_TMS_MASK )
+        tms_byte = GetOutByte( flags );
+    if( flags & PUT_TDI_MASK )
+        tdi_byte = GetOutByte( flags );
+    tdo_byte = 0; // Clear byte for receiving TDO bits.
+    bit_mask = ( flags & RAW_ORDER_MASK ) ? 0x80 : 0x01;   // Raw bytes are sent MSB-first.
+    for ( ; num_bits != 0U; num_bits-- )
+    {
+        if ( TDO )
+            tdo_byte |= bit_mask;
+        if( flags & PUT_TMS_MASK )
+            TMS = tms_byte & bit_mask ? 1 : 0;
+        if( flags & TMS_RLE_MASK )
+        {
+            while ( tms_run_left == 0U )
+                LoadTmsRun();   // This also sets the TMS pin to the level of the new run.
+            tms_run_left--;
+        }
+        if( flags & PUT_TDI_MASK )
+            TDI = tdi_byte & bit_mask ? 1 : 0;
+        TCK = 1;
+        TCK_DELAY();
+        TCK = 0;
+        TCK_DELAY();
+        if( flags & RAW_ORDER_MASK )
+            bit_mask >>= 1;
+        else
+            bit_mask <<= 1;
+    }
+    if( flags & GET_TDO_MASK )
+        *tdo++ = tdo_byte; // Store received TDO bits into the outgoing packet.
+} /* ShiftJtagBits */
+
+
+
+//
+// Shift whole bytes of bits at a TCK frequency below the maximum. If the MSSP is being used, each
+// byte is sent once the previous byte has finished. Otherwise, the bits are bit-banged with delays.
+//
+static void ShiftSlowBytes( BYTE flags, BYTE num_bytes, BYTE use_mssp )
+{
+    BYTE spi_byte;
+
+    for ( ; num_bytes != 0U; num_bytes-- )
+    {
+        #if USE_MSSP
+        if ( use_mssp )
+        {
+            spi_byte = 0;   // TDI is cleared while TDO is collected.
+            if ( flags & PUT_TDI_MASK )
+            {
+                spi_byte = *tms_tdi++;
+                if ( !( flags & RAW_ORDER_MASK ) )
+                    spi_byte = reverse_bits[spi_byte];
+                out_left--;
+            }
+            SSPBUF = spi_byte;
+            WaitMsspByte();     // Wait until the byte has been shifted at the selected TCK frequency.
+            spi_byte = SSPBUF;
+            if ( flags & GET_TDO_MASK )
+                *tdo++ = ( flags & RAW_ORDER_MASK ) ? spi_byte : reverse_bits[spi_byte];
+            continue;
+        }
+        #endif
+        ShiftJtagBits( flags, 8 );
+    }
+}
+
+
+
+//
+// Return the number of whole bytes of bits that can be shifted before another packet has to be
+// received from or sent to the host. Packets are exchanged here when that number falls to zero.
+//
+static BYTE GetShiftRoom( BYTE flags, BYTE unit_size )
+{
+    BYTE room;
+
+    if ( flags & ( PUT_TDI_MASK | PUT_TMS_MASK ) )
+    {
+        if ( out_left == 0U )
+            NextOutPacket( flags );
+        room = out_left / unit_size;    // This is zero if a TMS/TDI byte pair is split between packets.
+        // TDO bytes can be kept in the IN packet from the previous packet of TMS/TDI bits (so the packets
+        // are full for ZLP framing, or compressed ones are waiting), which leaves less room for new ones.
+        if ( flags & GET_TDO_MASK )
+        {
+            if ( tdo == (BYTE *)InPacket + USBGEN_EP_SIZE )
+                SendTdoPacket();
+            if ( room > (BYTE *)InPacket + USBGEN_EP_SIZE - tdo )
+                room = (BYTE *)InPacket + USBGEN_EP_SIZE - tdo;
+        }
+        return room;
+    }
+
+    // If we are only getting TDO bits, then there are no packets coming from the PC
+    // so just keep going until the outgoing packet is full.
+    if ( tdo == (BYTE *)InPacket + USBGEN_EP_SIZE )
+        SendTdoPacket();
+    return (BYTE *)InPacket + USBGEN_EP_SIZE - tdo;
+}
+
+
+
+//
+// Shift a stream of TMS/TDI bits that can be spread over several packets from the host and collect
+// the TDO bits into packets that are sent back.  The bits start at tms_tdi with out_left bytes
+// remaining in the current packet, and the TDO bits are stored starting at tdo.  The final
+// (possibly partial) packet of TDO bits is left for the caller to send.
+//
+static void ShiftJtagStream( BYTE flags, DWORD num_clks )
+{
+    DWORD num_shift_bytes;          // # of whole bytes of bits left to shift.
+    BYTE  shift_flags;              // Flags that select the loop for shifting whole bytes of bits.
+    BYTE  unit_size;                // # of bytes from the host that hold the TMS/TDI bits for eight clocks.
+    BYTE  n;                        // # of whole bytes of bits to shift in one pass.
+    BYTE  use_mssp;                 // True if whole bytes of bits are shifted with the MSSP.
+
+    shift_flags     = flags & ( PUT_TDI_MASK | PUT_TMS_MASK | GET_TDO_MASK | RAW_ORDER_MASK );
+    unit_size       = ( (flags & PUT_TDI_MASK) && (flags & PUT_TMS_MASK) ) ? 2 : 1;
+    num_shift_bytes = num_clks / 8;
+
+    #if USE_MSSP
+    // Use the MSSP for speed if TMS bits don't have to be sent and the TCK frequency is one the MSSP can make.
+    use_mssp = !( flags & PUT_TMS_MASK ) && ( tck_code < TCK_CODE_BB );
+    if ( use_mssp )
+        MSSP_ON();
+    #else
+    use_mssp = FALSE;
+    #endif
+
+    while ( num_shift_bytes != 0U )
+    {
+        if ( blink_counter == 0U )
+        {
+            blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+        }
+
+        n = GetShiftRoom( flags, unit_size );
+        if ( num_shift_bytes < n )
+            n = num_shift_bytes;
+        if ( n == 0U )
+        {
+            if ( out_left != 0U )
+            {
+                // The TMS and TDI bytes are in different packets, so bit-bang them.
+                ShiftJtagBits( flags, 8 );
+                num_shift_bytes--;
+            }
+            continue;   // Otherwise, got an empty packet, so go get another.
+        }
+
+        if ( flags & TMS_RLE_MASK )
+        {
+            while ( tms_run_left == 0U )
+                LoadTmsRun();
+            if ( tms_run_left < 8U )
+            {
+                // TMS changes somewhere within the next byte, so bit-bang it.
+                #if USE_MSSP
+                if ( use_mssp )
+                    MSSP_OFF();
+                #endif
+                ShiftJtagBits( flags, 8 );
+                #if USE_MSSP
+                if ( use_mssp )
+                    MSSP_ON();
+                #endif
+                num_shift_bytes--;
+                continue;
+            }
+            // Shift whole bytes at top speed while TMS stays constant.
+            if ( tms_run_left / 8 < n )
+                n = tms_run_left / 8;
+            tms_run_left -= (WORD)n * 8;
+        }
+
+        if ( ( tck_code == TCK_CODE_12MHZ ) && ( use_mssp || !( flags & RAW_ORDER_MASK ) ) )
+            ShiftJtagBytes( shift_flags, n );   // (Only the MSSP loops handle the raw bit-order.)
+        else
+            ShiftSlowBytes( shift_flags, n, use_mssp );
+        num_shift_bytes -= n;
+    }
+
+    #if USE_MSSP
+    MSSP_OFF(); // Turn off the MSSP.  The remaining bits are transmitted bit-bang style.
+    #endif
+
+    // Send the last few bits of the last byte of TMS/TDI bits.
+    // (This computation only works because num_clks != 0.)
+    if ( num_clks & 0x7 )
+    {
+        GetShiftRoom( flags, unit_size );
+        ShiftJtagBits( flags, num_clks & 0x7 );
+    }
+} /* ShiftJtagStream */
+
+
+
+//
+// Return the state the TAP controller will enter on the next TCK pulse with the given TMS level.
+//
+static BYTE TapNextState( BYTE tms )
+{
+    if ( tms )
+        return tap_next[tap_state] >> 4;
+    return tap_next[tap_state] & 0x0F;
+}
+
+
+
+//
+// Update the TAP state after TCK has been pulsed a number of times while TMS was held at a constant level.
+// Five pulses with TMS high will always reset the TAP, and TMS low leaves the TAP in a stable state after
+// two pulses, so there is no need to step through more than five pulses.
+//
+static void TapTrack( BYTE tms, DWORD num_clks )
+{
+    if ( tms && ( num_clks >= 5U ) )
+    {
+        tap_state = TAP_RESET;
+        return;
+    }
+    if ( tap_state == TAP_UNKNOWN )
+        return;
+    if ( num_clks > 5U )
+        num_clks = 5U;
+    for ( ; num_clks != 0U; num_clks-- )
+        tap_state = TapNextState( tms );
+}
+
+
+
+//
+// Move the TAP controller to the target state along the shortest path. The TAP is reset first if its
+// current state is not known.
+//
+static void TapGoto( BYTE target )
+{
+    BYTE tms;
+
+    TCK = 0;
+    if ( tap_state == TAP_UNKNOWN )
+    {
+        TMS = 1;
+        for ( tms = 5; tms != 0U; tms-- )
+        {
+            TCK = 1;
+            TCK_DELAY();
+            TCK = 0;
+            TCK_DELAY();
+        }
+        tap_state = TAP_RESET;
+    }
+    while ( tap_state != target )
+    {
+        tms       = ( tap_tms_to[target] >> tap_state ) & 0x01;
+        TMS       = tms;
+        TCK       = 1;
+        TCK_DELAY();
+        TCK       = 0;
+        TCK_DELAY();
+        tap_state = TapNextState( tms );
+    }
+}
+
+
+
+//
+// Start TIMER1 counting instruction cycles so microsecond delays can be timed.
+//
+static void StartUsTimer( void )
+{
+    T1CON           = 0b10000000;   // 16-bit reads, 12 MHz clock input to TIMER1; TIMER1 disabled.
+    TMR1H           = 0;
+    TMR1L           = 0;
+    PIR1bits.TMR1IF = 0;
+    us_timer_ovfls  = 0;
+    T1CONbits.TMR1ON = 1;   // Enable TIMER1.
+}
+
+
+
+//
+// Count a TIMER1 overflow if one has occurred. This has to be called at least once every 5.4 ms
+// while the microsecond timer is running so no overflows are missed.
+//
+static void PollUsTimer( void )
+{
+    if ( PIR1bits.TMR1IF )
+    {
+        PIR1bits.TMR1IF = 0;
+        us_timer_ovfls++;
+    }
+}
+
+
+
+//
+// Wait until at least the given number of microseconds have passed since the microsecond timer was started.
+//
+static void WaitUsTimer( DWORD us )
+{
+    DWORD ticks;
+    WORD  tmr1;
+
+    if ( us > 0xFFFFFFFFUL / MIPS )
+        us = 0xFFFFFFFFUL / MIPS;   // Limit the delay so the number of timer ticks doesn't overflow.
+    ticks = us * MIPS;
+
+    // Wait for the upper half of the tick count to be reached through TIMER1 overflows.
+    do
+    {
+        PollUsTimer();
+        SERVICE_WAIT();
+    } while ( us_timer_ovfls < (WORD)( ticks >> 16 ) );
+
+    // Then wait for TIMER1 to reach the lower half of the tick count.
+    while ( us_timer_ovfls == (WORD)( ticks >> 16 ) )
+    {
+        tmr1  = TMR1L;  // Reading the low byte latches the high byte.
+        tmr1 |= (WORD)TMR1H << 8;
+        if ( tmr1 >= (WORD)ticks )
+            break;
+        PollUsTimer();
+        SERVICE_WAIT();
+    }
+    T1CONbits.TMR1ON = 0;   // Disable TIMER1.
+}
+
+
+
+//
+// Pulse TCK the given number of times with TMS held low. Whole bytes of pulses are sent by feeding zeros
+// through the MSSP and the remaining few pulses are bit-banged. The microsecond timer is polled along the way.
+//
+static void RuntestClocks( DWORD num_clks )
+{
+    DWORD num_bytes;
+
+    TCK = 0;
+    TMS = 0;
+
+    #if USE_MSSP
+    num_bytes = num_clks / 8;
+    if ( ( num_bytes != 0U ) && ( tck_code < TCK_CODE_BB ) )
+    {
+        MSSP_ON();
+        while ( num_bytes != 0U )
+        {
+            if ( blink_counter == 0U )
+            {
+                blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+            }
+            SERVICE_WAIT(); // Keep the USB stack and the control requests going between passes of a long RUNTEST.
+
+            // Send up to 256 bytes of zeros through the MSSP in each pass. (A count of zero makes the loop run 256 times.)
+            if ( num_bytes >= 256U )
+            {
+                buffer_cntr = 0;
+                num_bytes  -= 256;
+            }
+            else
+            {
+                buffer_cntr = (BYTE)num_bytes;
+                num_bytes   = 0;
+            }
+            if ( tck_code == TCK_CODE_12MHZ )
+            {
+                // Each pass of the loop takes 11 instruction cycles, so the previous byte (8 cycles at Fosc/4)
+                // is done before its buffer-full flag is cleared and the next byte is sent.
+                _asm
+RUNTEST_LOOP_0:
+                MOVF SSPBUF, 0, ACCESS          // Read the SPI buffer to clear the buffer-full flag of the previous byte.
+                CLRF SSPBUF, ACCESS             // Send eight TCK pulses with zeros on TDI.
+                NOP
+                NOP
+                NOP
+                NOP
+                NOP
+                NOP
+                DECFSZ buffer_cntr, 1, ACCESS   // Decrement the byte counter and leave the loop when it reaches zero.
+                BRA RUNTEST_LOOP_0
+                _endasm
+                WaitMsspByte(); // Wait for the final byte of the pass to go out.
+                WREG = SSPBUF;
+            }
+            else
+            {
+                // Wait for each byte to go out at the selected TCK frequency before sending the next.
+                do
+                {
+                    SSPBUF = 0;
+                    WaitMsspByte();
+                    WREG = SSPBUF;
+                } while ( --buffer_cntr != 0U );
+            }
+            PollUsTimer();
+        }
+        MSSP_OFF();
+        num_clks &= 0x7;
+    }
+    #endif
+
+    // Bit-bang the remaining TCK pulses.
+    for ( ; num_clks != 0U; num_clks-- )
+    {
+        TCK = 1;
+        TCK_DELAY();
+        TCK = 0;
+        TCK_DELAY();
+        if ( tck_delay || ( (BYTE)num_clks == 0U ) )
+        {
+            PollUsTimer();
+            SERVICE_WAIT();
+        }
+    }
+}
+
+
+
+//
+// Set up the TMS runs for a scan so that TMS stays low while all but the last bit is shifted and then
+// goes high on the last bit to leave the Shift-IR or Shift-DR state.
+//
+static void SetScanTmsRuns( DWORD num_clks )
+{
+    TMS           = 0;
+    tms_run_left  = num_clks - 1;
+    tms_runs[0]   = TMS_RUN_LEVEL_MASK | 1;
+    num_tms_runs  = 1;
+    tms_run_index = 0;
+}
+
+
+
+//
+// Point to the TMS/TDI bits that follow a command header. In packet mode they start right after the header
+// in the same packet. In stream mode, the header has already been read from the stream so they are next.
+//
+static void StartOutData( BYTE hdr_len )
+{
+    if ( comm_mode == COMM_MODE_PACKET )
+    {
+        tms_tdi  = (BYTE *)OutPacket + hdr_len;
+        out_left = OutPacketLength - hdr_len;
+    }
+}
+
+
+
+//
+// Shift the bits of a compare scan and check the TDO bits against the expected bits as each byte is captured.
+// TMS is held low until the last bit, which moves the TAP out of the Shift state. Returns the offset of the
+// first bit that didn't match, or NO_MISMATCH.
+//
+static DWORD ShiftCompareStream( BYTE flags, DWORD num_clks )
+{
+    DWORD offset;                   // Offset of the first bit in the current byte.
+    DWORD mismatch = NO_MISMATCH;   // Offset of the first bit that didn't match.
+    BYTE  tdi_byte, exp_byte, mask_byte, tdo_byte;
+    BYTE  num_bits;                 // Number of bits in the current byte.
+    BYTE  bit_mask;                 // Mask to select bit from a byte.
+    BYTE  use_mssp;                 // True if whole bytes are shifted with the MSSP.
+    BYTE  i;
+
+    #if USE_MSSP
+    use_mssp = ( tck_code < TCK_CODE_BB );
+    if ( use_mssp )
+        MSSP_ON();
+    #else
+    use_mssp = FALSE;
+    #endif
+
+    TMS = 0;
+    for ( offset = 0; offset < num_clks; offset += 8 )
+    {
+        if ( blink_counter == 0U )
+        {
+            blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+        }
+
+        tdi_byte  = ( flags & TDI_VAL_MASK ) ? 0xFF : 0x00;
+        if ( flags & PUT_TDI_MASK )
+            tdi_byte = GetOutByte( 0 );
+        exp_byte  = GetOutByte( 0 );
+        mask_byte = GetOutByte( 0 );
+        num_bits  = ( num_clks - offset > 8U ) ? 8 : (BYTE)( num_clks - offset );
+
+        #if USE_MSSP
+        if ( use_mssp && ( num_clks - offset > 8U ) )
+        {
+            // Shift a whole byte that isn't the last one through the MSSP.
+            SSPBUF = ( flags & RAW_ORDER_MASK ) ? tdi_byte : reverse_bits[tdi_byte];
+            WaitMsspByte();     // Wait until the byte has been shifted at the selected TCK frequency.
+            tdo_byte = SSPBUF;
+            if ( !( flags & RAW_ORDER_MASK ) )
+                tdo_byte = reverse_bits[tdo_byte];
+        }
+        else
+        #endif
+        {
+            // Bit-bang the last byte so TMS can be raised on the last bit.
+            #if USE_MSSP
+            if ( use_mssp )
+            {
+                MSSP_OFF();
+                use_mssp = FALSE;
+            }
+            #endif
+            tdo_byte = 0;
+            bit_mask = ( flags & RAW_ORDER_MASK ) ? 0x80 : 0x01;   // Raw bytes are sent MSB-first.
+            for ( i = num_bits; i != 0U; i-- )
+            {
+                if ( TDO )
+                    tdo_byte |= bit_mask;
+                if ( ( i == 1U ) && ( num_clks - offset <= 8U ) )
+                    TMS = 1;    // Raise TMS on the last bit to exit the Shift state.
+                TDI = tdi_byte & bit_mask ? 1 : 0;
+                TCK = 1;
+                TCK_DELAY();
+                TCK = 0;
+                TCK_DELAY();
+                if ( flags & RAW_ORDER_MASK )
+                    bit_mask >>= 1;
+                else
+                    bit_mask <<= 1;
+            }
+        }
+
+        // Find the offset of the first bit that didn't match under the mask.
+        if ( ( mismatch == NO_MISMATCH ) && ( ( tdo_byte ^ exp_byte ) & mask_byte ) )
+        {
+            bit_mask = ( flags & RAW_ORDER_MASK ) ? 0x80 : 0x01;
+            for ( i = 0; i < num_bits; i++ )
+            {
+                if ( ( tdo_byte ^ exp_byte ) & mask_byte & bit_mask )
+                    break;
+                if ( flags & RAW_ORDER_MASK )
+                    bit_mask >>= 1;
+                else
+                    bit_mask <<= 1;
+            }
+            if ( i < num_bits )
+                mismatch = offset + i;
+        }
+    }
+
+    #if USE_MSSP
+    if ( use_mssp )
+        MSSP_OFF();
+    #endif
+    return mismatch;
+}
+
+
+
+//
+// Shift a run of identical TDI bytes. The MSSP sends them at the selected TCK frequency if it is on.
+// Otherwise, TCK is bit-banged with TDI held at the level of the run.
+//
+static void ShiftTdiRun( BYTE tdi_byte, WORD num_bytes, BYTE use_mssp )
+{
+    BYTE i;
+
+    #if USE_MSSP
+    if ( use_mssp )
+    {
+        tdi_bits = tdi_byte;
+        while ( num_bytes != 0U )
+        {
+            if ( blink_counter == 0U )
+            {
+                blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+            }
+            SERVICE_USB();  // Keep the USB stack running between passes of a long run.
+
+            // Send up to 256 bytes of the run in each pass. (A count of zero makes the loop run 256 times.)
+            if ( num_bytes >= 256U )
+            {
+                buffer_cntr = 0;
+                num_bytes  -= 256;
+            }
+            else
+            {
+                buffer_cntr = (BYTE)num_bytes;
+                num_bytes   = 0;
+            }
+            if ( tck_code == TCK_CODE_12MHZ )
+            {
+                // Each pass of the loop takes 11 instruction cycles, so the previous byte (8 cycles at Fosc/4)
+                // is done before its buffer-full flag is cleared and the next byte is sent.
+                _asm
+                MOVF tdi_bits, 0, ACCESS        // Keep the TDI byte of the run in W.
+TDI_RUN_LOOP_0:
+                MOVFF SSPBUF, TBLPTRL           // Read the SPI buffer to clear the buffer-full flag of the previous byte.
+                MOVWF SSPBUF, ACCESS            // Send eight TCK pulses with the run byte on TDI.
+                NOP
+                NOP
+                NOP
+                NOP
+                NOP
+                DECFSZ buffer_cntr, 1, ACCESS   // Decrement the byte counter and leave the loop when it reaches zero.
+                BRA TDI_RUN_LOOP_0
+                _endasm
+                WaitMsspByte(); // Wait for the final byte of the pass to go out.
+                WREG = SSPBUF;
+            }
+            else
+            {
+                // Wait for each byte to go out at the selected TCK frequency before sending the next.
+                do
+                {
+                    SSPBUF = tdi_bits;
+                    WaitMsspByte();
+                    WREG = SSPBUF;
+                } while ( --buffer_cntr != 0U );
+            }
+        }
+        return;
+    }
+    #endif
+
+    TDI = tdi_byte ? 1 : 0;
+    for ( ; num_bytes != 0U; num_bytes-- )
+    {
+        if ( blink_counter == 0U )
+        {
+            blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+        }
+        for ( i = 8; i != 0U; i-- )
+        {
+            TCK = 1;
+            TCK_DELAY();
+            TCK = 0;
+            TCK_DELAY();
+        }
+        if ( (BYTE)num_bytes == 0U )
+            SERVICE_USB();
+    }
+}
+
+
+
+//
+// Expand the literals and runs of a TDI_RLE_CMD and shift the TDI bits. All but the final byte are shifted
+// with the MSSP (if the TCK frequency allows it), and the final bits are bit-banged with TMS raised on the
+// last one to leave the Shift state.
+//
+static void ShiftTdiRle( DWORD num_clks )
+{
+    DWORD num_shift_bytes;          // # of whole bytes of bits left to shift before the final byte.
+    WORD  run_left = 0;             // # of bytes left in the current run.
+    WORD  run_len;                  // # of bytes of the current run to shift in one pass.
+    BYTE  run_byte;                 // TDI byte that is repeated in the current run.
+    BYTE  lit_left = 0;             // # of bytes left in the current literal.
+    BYTE  code;                     // Code byte that starts a literal or a run.
+    BYTE  n;                        // # of literal bytes to shift in one pass.
+    BYTE  use_mssp;                 // True if whole bytes of bits are shifted with the MSSP.
+
+    num_shift_bytes = ( num_clks - 1 ) / 8;    // The byte with the last bit is always bit-banged.
+    TCK = 0;
+    TMS = 0;
+
+    #if USE_MSSP
+    use_mssp = ( tck_code < TCK_CODE_BB );
+    if ( use_mssp )
+        MSSP_ON();
+    #else
+    use_mssp = FALSE;
+    #endif
+
+    for ( ;; )
+    {
+        if ( ( run_left == 0U ) && ( lit_left == 0U ) )
+        {
+            // Decode the next literal or run.
+            code = GetOutByte( 0 );
+            if ( code & TDI_RLE_RUN_MASK )
+            {
+                run_byte = ( code & TDI_RLE_ONES_MASK ) ? 0xFF : 0x00;
+                run_left = ( ( (WORD)( code & TDI_RLE_LEN_MASK ) << 8 ) | GetOutByte( 0 ) ) + 1;
+            }
+            else
+                lit_left = code + 1;
+        }
+        if ( num_shift_bytes == 0U )
+            break;  // Only the final byte is left.
+
+        if ( run_left != 0U )
+        {
+            // A run costs nothing from the host, so it goes out as fast as the TCK frequency allows.
+            run_len = ( run_left < num_shift_bytes ) ? run_left : (WORD)num_shift_bytes;
+            ShiftTdiRun( run_byte, run_len, use_mssp );
+            run_left        -= run_len;
+            num_shift_bytes -= run_len;
+        }
+        else
+        {
+            while ( out_left == 0U )
+                NextOutPacket( 0 );
+            n = lit_left;
+            if ( out_left < n )
+                n = out_left;
+            if ( num_shift_bytes < n )
+                n = num_shift_bytes;
+            if ( tck_code == TCK_CODE_12MHZ )
+                ShiftJtagBytes( PUT_TDI_MASK, n );
+            else
+                ShiftSlowBytes( PUT_TDI_MASK, n, use_mssp );
+            lit_left        -= n;
+            num_shift_bytes -= n;
+        }
+    }
 
-    // Process EEPROM flags only AFTER FPGA tries to config from flash.
-    ProcessEepromFlags();       // Process the non-volatile flags stored in EEPROM.
+    #if USE_MSSP
+    if ( use_mssp )
+        MSSP_OFF(); // Turn off the MSSP.  The remaining bits are transmitted bit-bang style.
+    #endif
 
-    FPGACLK_ON();               // Give the FPGA a clock whether it is configured or not.
+    // Send the final bits of the last byte and raise TMS on the last one.
+    n = (BYTE)( num_clks - ( ( num_clks - 1 ) / 8 ) * 8 );
+    SetScanTmsRuns( n );
+    if ( run_left != 0U )
+    {
+        TDI = run_byte ? 1 : 0;
+        ShiftJtagBits( TMS_RLE_MASK, n );
+    }
+    else
+        ShiftJtagBits( PUT_TDI_MASK | TMS_RLE_MASK, n );
 }
 
 
 
-// This function is called when the device becomes initialized, which occurs after the host sends a
-// SET_CONFIGURATION (wValue not = 0) request.  This callback function should initialize the endpoints
-// for the device's usage according to the current configuration.
-void USBCBInitEP( void )
+//
+// Assemble the header of the next command in the byte stream into CmdPacket. Returns TRUE once
+// a command is ready, or FALSE if there are no more bytes from the host yet.
+//
+static BOOL GetStreamCommand( void )
 {
-    // Enable the endpoint.
-    USBEnableEndpoint( USBGEN_EP_NUM, USB_OUT_ENABLED | USB_IN_ENABLED | USB_HANDSHAKE_ENABLED | USB_DISALLOW_SETUP );
-    // Now begin waiting for the first packets to be received from the host via this endpoint.
-    OutIndex = 0;
-    OutHandle[0] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[0], USBGEN_EP_SIZE );
-    OutHandle[1] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[1], USBGEN_EP_SIZE );
-    // Initialize the pointer to the buffer which will return data to the host via this endpoint.
-    InIndex = 0;
-    InPacket  = &InBuffer[0];
+    BYTE hdr_len, i;
+
+    if ( ( out_left == 0U ) && out_held )
+    {
+        // The current packet has been used up, so give it back to the USB engine.
+        OUT_RELEASE();
+        out_held = FALSE;
+    }
+    if ( !out_held )
+    {
+        if ( OUT_BUSY() )
+            return FALSE;   // No packet from the host yet.
+        tms_tdi  = (BYTE *)OUT_BUFFER();
+        out_left = OUT_LENGTH();
+        out_held = TRUE;
+        if ( out_left == 0U )
+            return FALSE;
+    }
+
+    hdr_len = GetOutByte( 0 );
+    if ( hdr_len == 0U )
+        return FALSE;   // A zero length is just padding.
+    if ( hdr_len > sizeof( DATA_PACKET ) )
+    {
+        out_left = 0;   // The stream is garbled, so drop the rest of this packet.
+        cmd_status |= STATUS_BAD_FRAME;
+        return FALSE;
+    }
+    // The rest of the header may be in the next packet, so this can wait for it to arrive.
+    for ( i = 0; i < hdr_len; i++ )
+        CmdPacket._byte[i] = GetOutByte( 0 );
+    OutPacket       = &CmdPacket;
+    OutPacketLength = hdr_len;
+    return TRUE;
 }
 
 
 
-void ProcessIO( void )
+//
+// Return the largest response the current command can return if it can be collected with other small responses,
+// or NO_COALESCE if any collected responses have to be sent before the command is handled.
+//
+static BYTE GetCoalescedLength( BYTE cmd )
 {
-    if ( ( USBGetDeviceState() < CONFIGURED_STATE ) || USBIsDeviceSuspended() )
-        return;
+    switch ( cmd )
+    {
+        case ID_BOARD_CMD:
+        case ENABLE_RETURN_CMD:
+        case WRITE_EEDATA_CMD:
+            return 1;
+        case TMS_TDI_TDO_CMD:
+        case FLASH_ONOFF_CMD:
+        case SET_TDO_WINDOWS_CMD:
+            return 2;
+        case AIO0_ADC_CMD:
+        case AIO1_ADC_CMD:
+            return 3;
+        case SYNC_CMD:
+            return 4;
+        case RX_STATS_CMD:
+            return 5;
+        case RUNTEST_CMD:
+        case SET_TCK_FREQ_CMD:
+            return 5;
+        case INFO_CMD:
+            return sizeof( DEVICE_INFO ) + 1;
+        case READ_EEDATA_CMD:
+            if ( OutPacket->len > USBGEN_EP_SIZE - 5 )
+                return NO_COALESCE;
+            return OutPacket->len + 5;
+        case TMS_TDI_CMD:
+        case PROG_CMD:
+        case DISABLE_RETURN_CMD:
+            return 0;
+        default:
+            return NO_COALESCE;
+    } /* switch */
+}
 
-    ServiceRequests();
+
+
+//
+// Return TRUE if the collected responses have waited for the coalescing timeout.
+//
+static BOOL CoalesceTimedOut( void )
+{
+    return (WORD)( in_fill_tick - GetRuntestTimer() ) >= coalesce_ticks;   // The runtest timer counts down.
 }
 
 
@@ -378,27 +3375,64 @@ void ServiceRequests( void )
 {
     BYTE num_return_bytes;          // Number of bytes to return in response to received command.
     BYTE *tdi;                      // Pointer to the buffer of received TDI bits.
-    BYTE *tdo;                      // Pointer to the buffer for returning TDO bits.
-    BYTE *tms_tdi;                  // Pointer to the buffer of received TDI & TMS bits.
     DWORD num_clks;                 // # of TCK pulses to send TMS/TDI bits to JTAG device.
     DWORD num_bytes;                // # of total bytes in the stream of TMS/TDI/TDO bits.
     BYTE flags;                     // local storage for JTAG_CMD flags.
+    BYTE end_state;                 // TAP state at the end of a scan command.
+    BYTE num_segs;                  // Number of DR segments in a SCAN_DR_SEGS_CMD.
+    BYTE seg;                       // Index of the DR segment being shifted.
+    BYTE num_poll_bytes;            // Number of bytes of TDI, mask and compare bits for a POLL_DR_CMD.
+    WORD num_iters;                 // Number of scans done by a POLL_DR_CMD.
+    WORD max_iters;                 // Maximum number of scans for a POLL_DR_CMD.
+    WORD time_limit;                // Time limit of a POLL_DR_CMD in ticks of the runtest timer.
+    WORD poll_start;                // Runtest timer reading when a POLL_DR_CMD started.
+    BYTE *poll_tdi, *poll_mask, *poll_cmp;  // Pointers to the TDI, mask and compare bits of a POLL_DR_CMD.
+    BYTE *save_tms_tdi;             // Position in the command stream while a POLL_DR_CMD shifts its own TDI bits.
+    BYTE save_out_left;             // Bytes left in the stream packet while a POLL_DR_CMD shifts its own TDI bits.
     BYTE bit_mask;                  // Mask to select bit from a byte.
     BYTE bit_cntr;                  // Counter within a byte of bits.
-    BYTE tms_byte, tdi_byte, tdo_byte;      // Temporary bytes of TMS, TDI and TDO bits.
+    BYTE tdi_byte, tdo_byte;        // Temporary bytes of TDI and TDO bits.
     BYTE cmd;                     // Store the command in the received packet.
+    BOOL stream;                    // True if this command came from the byte stream.
+    DWORD mismatch;                 // Offset of the first TDO bit that didn't match in a compare scan.
+    BYTE rsp_len;                   // Largest response of the command if it can be collected with other responses.
+
+    // Send any collected responses that have waited too long for more to join them.
+    if ( ( in_fill != 0U ) && CoalesceTimedOut() )
+        FlushInPacket();
 
     // Process packets received through the primary endpoint.
-    if ( !USBHandleBusy( OutHandle[OutIndex] ) )
+    stream = ( comm_mode == COMM_MODE_STREAM );
+    if ( stream ? GetStreamCommand() : !OUT_BUSY() )
     {
         num_return_bytes = 0;   // Initially, assume nothing needs to be returned.
 
-        // Got a packet, so start getting another packet while we process this one.
-        OutPacket        = &OutBuffer[OutIndex]; // Store pointer to just-received packet.
-        OutPacketLength  = USBHandleGetLength( OutHandle[OutIndex] );   // Store length of received packet.
+        if ( !stream )
+        {
+            // Got a packet, so start getting another packet while we process this one.
+            OutPacket        = OUT_BUFFER(); // Store pointer to just-received packet.
+            OutPacketLength  = OUT_LENGTH();   // Store length of received packet.
+        }
         cmd              = OutPacket->cmd;
 
+        // Build a small response after the ones already collected, or send them first if this response won't fit.
+        rsp_len = NO_COALESCE;
+        if ( coalesce_ticks != 0U )
+        {
+            rsp_len = GetCoalescedLength( cmd );
+            if ( ( rsp_len == NO_COALESCE ) || ( rsp_len > USBGEN_EP_SIZE - in_fill ) )
+                FlushInPacket();
+            if ( rsp_len != NO_COALESCE )
+                InPacket = (DATA_PACKET *)( (BYTE *)&InBuffer[InIndex] + in_fill );
+        }
+
         blink_counter    = NUM_ACTIVITY_BLINKS; // Blink the LED whenever a USB transaction occurs.
+        last_in_full     = FALSE;
+        crc_tdo          = FALSE;
+        win_tdo          = FALSE;
+        #if USE_TDO_RLE
+        rle_tdo          = FALSE;
+        #endif
 
         switch ( cmd )  // Process the contents of the packet based on the command byte.
         {
@@ -422,7 +3456,9 @@ void ServiceRequests( void )
                 TMS = OutPacket->tms;
                 TDI = OutPacket->tdi;
                 TCK = 1;
+                TCK_DELAY();
                 TCK = 0;
+                TapTrack( OutPacket->tms, 1 );
                 // Don't return any packets.
                 break;
 
@@ -433,13 +3469,28 @@ void ServiceRequests( void )
                 TMS              = OutPacket->tms;
                 TDI              = OutPacket->tdi;
                 TCK              = 1;
+                TCK_DELAY();
                 TCK              = 0;
+                TapTrack( OutPacket->tms, 1 );
                 num_return_bytes = 2;           // Return the packet with the TDO value in it.
                 break;
 
             case TDI_CMD:       // get USB packets of TDI data, output data to TDI pin of JTAG device
             case TDI_TDO_CMD:   // get USB packets, output data to TDI pin, input data from TDO pin, send USB packets
             case TDO_CMD:       // input data from TDO pin of JTAG device, send USB packets of TDO data
+                if ( stream )
+                {
+                    // These commands handle their own packets, so they can't be used in stream mode. Skip over
+                    // any TDI bytes that follow so they aren't taken for command headers.
+                    cmd_status |= STATUS_BAD_CMD;
+                    if ( cmd != TDO_CMD )
+                    {
+                        for ( num_bytes = ( OutPacket->num_clks + 7 ) / 8; num_bytes != 0U; num_bytes-- )
+                            GetOutByte( 0 );
+                    }
+                    break;
+                }
+
                 blink_counter = MAX_BYTE_VAL;   // Blink LED continuously during the long duration of this command.
 
                 // The first packet received contains the TDI_CMD command and the number
@@ -451,9 +3502,42 @@ void ServiceRequests( void )
                     break;
                 num_bytes     = ( num_clks + 7 ) / 8; // Total number of bytes in all the packets that will follow.
 
+                // Fold the TDO bits into a CRC if the optional flags byte asks for it.
+                if ( ( cmd != TDI_CMD ) && ( OutPacketLength > 5U ) && ( OutPacket->flags & CRC_TDO_MASK ) )
+                {
+                    crc_tdo = TRUE;
+                    tdo_crc = 0xFFFFFFFFUL;
+                }
+                else if ( cmd != TDI_CMD )
+                    StartTdoWindows( 0 );
+
                 TCK           = 0; // Initialize TCK (should have been low already).
                 TMS           = 0; // Initialize TMS to keep TAP FSM in Shift-IR or Shift-DR state).
 
+                // The loops below only shift at the fastest TCK frequency, so the slower frequencies use the same
+                // shifter as the JTAG command. TMS goes high on the last bit and the TDI bits start in the next packet.
+                if ( tck_code != TCK_CODE_12MHZ )
+                {
+                    flags    = ( cmd == TDI_CMD ) ? PUT_TDI_MASK : ( ( cmd == TDO_CMD ) ? GET_TDO_MASK : ( PUT_TDI_MASK | GET_TDO_MASK ) );
+                    TDI      = 0;                   // TDI is held low when only TDO bits are collected.
+                    out_left = 0;                   // The TDI bits start in the next packet.
+                    tdo      = (BYTE *)InPacket;
+                    SetScanTmsRuns( num_clks );
+                    ShiftJtagStream( flags | TMS_RLE_MASK, num_clks );
+                    if ( flags & GET_TDO_MASK )
+                        num_return_bytes = tdo - (BYTE *)InPacket;
+
+                    if ( ( tap_state == TAP_SHIFT_DR ) || ( tap_state == TAP_SHIFT_IR ) )
+                        tap_state = TapNextState( 1 );
+                    else
+                        tap_state = TAP_UNKNOWN;
+                    if ( blink_counter < MAX_BYTE_VAL - NUM_ACTIVITY_BLINKS )
+                        blink_counter = 0;
+                    else
+                        blink_counter -= ( MAX_BYTE_VAL - NUM_ACTIVITY_BLINKS );
+                    break;
+                }
+
                 #if USE_MSSP
                 if ( num_clks > 8U )
                 {
@@ -467,14 +3551,13 @@ void ServiceRequests( void )
                 {
                     // Wait until a completely filled packet of TDI bits arrives.
                     // This command packet has been handled, so get another.
-                    OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE );
-                    OutIndex ^= 1; // Point to next ping-pong buffer.
+                    OUT_RELEASE();
 
                     // Wait until the next packet of TMS & TDI bits arrives.
-                    while ( USBHandleBusy( OutHandle[OutIndex] ) )
-                        ;
-                    OutPacketLength = USBHandleGetLength( OutHandle[OutIndex] );    // Store length of received packet.
-                    OutPacket       = &OutBuffer[OutIndex]; // Store pointer to just-received packet.
+                    while ( OUT_BUSY() )
+                        SERVICE_WAIT();
+                    OutPacketLength = OUT_LENGTH();    // Store length of received packet.
+                    OutPacket       = OUT_BUFFER(); // Store pointer to just-received packet.
                     tdi             = (BYTE *)OutPacket; // Init pointer to the just-received TDI data.
                 }
                 else if( cmd = TDO_CMD )
@@ -815,12 +3898,18 @@ PRI_TDO_LOOP_0:
 
                     // Once all the TDI bits from a complete packet are sent to the JTAG port,
                     // send all the recorded TDO bits back in a complete packet.
-                    if ( ( cmd == TDI_TDO_CMD ) || ( cmd == TDO_CMD ) )
+                    if ( crc_tdo || win_tdo )
+                    {
+                        TakeTdoBytes( (BYTE *)InPacket, OutPacketLength );
+                        tdo = (BYTE *)InPacket;
+                    }
+                    else if ( ( cmd == TDI_TDO_CMD ) || ( cmd == TDO_CMD ) )
                     {
+                        last_in_full      = ( OutPacketLength == USBGEN_EP_SIZE );
                         InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)InPacket, OutPacketLength );
-                        InIndex ^= 1;
+                        InIndex ^= IN_INDEX_TOGGLE;
                         while ( USBHandleBusy( InHandle[InIndex] ) )
-                            ;                             // Wait until USB transmitter is not busy.
+                            SERVICE_WAIT();               // Wait until USB transmitter is not busy.
                         InPacket = &InBuffer[InIndex];
                         tdo      = (BYTE *)InPacket; // TDO data will be written here.
                     }
@@ -829,14 +3918,13 @@ PRI_TDO_LOOP_0:
                     {
                         // Wait until a completely filled packet of TDI bits arrives.
                         // This command packet has been handled, so get another.
-                        OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE );
-                        OutIndex ^= 1; // Point to next ping-pong buffer.
+                        OUT_RELEASE();
     
                         // Wait until the next packet of TMS & TDI bits arrives.
-                        while ( USBHandleBusy( OutHandle[OutIndex] ) )
-                            ;
-                        OutPacketLength = USBHandleGetLength( OutHandle[OutIndex] );    // Store length of received packet.
-                        OutPacket       = &OutBuffer[OutIndex]; // Store pointer to just-received packet.
+                        while ( OUT_BUSY() )
+                            SERVICE_WAIT();
+                        OutPacketLength = OUT_LENGTH();    // Store length of received packet.
+                        OutPacket       = OUT_BUFFER(); // Store pointer to just-received packet.
                         tdi             = (BYTE *)OutPacket; // Init pointer to the just-received TDI data.
                     }
 
@@ -911,6 +3999,12 @@ BF_TEST_LOOP_1:
                     num_return_bytes = num_bytes;
                 }
 
+                // TMS was raised on the final bit, so a TAP that was in a Shift state has moved to the Exit1 state.
+                if ( ( tap_state == TAP_SHIFT_DR ) || ( tap_state == TAP_SHIFT_IR ) )
+                    tap_state = TapNextState( 1 );
+                else
+                    tap_state = TAP_UNKNOWN;
+
                 // Blink the LED a few times after a long command completes.
                 if ( blink_counter < MAX_BYTE_VAL - NUM_ACTIVITY_BLINKS )
                     blink_counter = 0;  // Already done enough LED blinks.
@@ -918,6 +4012,23 @@ BF_TEST_LOOP_1:
                     blink_counter -= ( MAX_BYTE_VAL - NUM_ACTIVITY_BLINKS );    // Do at least the minimum number of blinks.
                 break;
 
+            case TDI_RLE_CMD:   // Expand run-length encoded TDI bytes and output them to the TDI pin of the JTAG device.
+                num_clks = OutPacket->num_clks;
+
+                // Exit if no TDI bits will follow (this is probably an error...).
+                if ( num_clks == 0U )
+                    break;
+
+                StartOutData( TDI_RLE_HDR_LEN );   // Point to the literals and runs that follow the command bytes.
+                ShiftTdiRle( num_clks );
+
+                // TMS was raised on the final bit, so a TAP that was in a Shift state has moved to the Exit1 state.
+                if ( ( tap_state == TAP_SHIFT_DR ) || ( tap_state == TAP_SHIFT_IR ) )
+                    tap_state = TapNextState( 1 );
+                else
+                    tap_state = TAP_UNKNOWN;
+                break;
+
             case JTAG_CMD:       // Output TMS & TDI values; get TDO value
 
                 // The first packet received contains the JTAG_CMD command and the number
@@ -930,6 +4041,11 @@ BF_TEST_LOOP_1:
 
                 // Get flags from the first packet that indicate how TMS and TDO bits are handled.
                 flags = OutPacket->flags;
+                if ( ( flags & ( CRC_TDO_MASK | GET_TDO_MASK ) ) == ( CRC_TDO_MASK | GET_TDO_MASK ) )
+                {
+                    crc_tdo = TRUE;
+                    tdo_crc = 0xFFFFFFFFUL;
+                }
 
                 // Initialize TCK, TMS and TDI levels.
                 TCK        = 0;                     // Initialize TCK (should have been low already).
@@ -942,291 +4058,423 @@ BF_TEST_LOOP_1:
                     TDI = ( flags & TDI_VAL_MASK ) ? 1 : 0; // No TDI bits in packets, so set TDI to the static value indicated in the flag bit.
                 }
                 // Keep only the flags we need at this point. (Reduces code size.)
-                flags &= ( PUT_TDI_MASK | PUT_TMS_MASK | GET_TDO_MASK );
-
-                // Total number of header+TMS+TDI bytes in all the packets for this command.
-                num_bytes  = (DWORD)( ( num_clks + 7 ) / 8 );
-                if ( (flags & PUT_TDI_MASK) && (flags & PUT_TMS_MASK) )
-                    num_bytes *= 2; // Twice the number of bytes if TMS and TDI bits are both being sent.
-                OutPacketLength -= JTAG_CMD_HDR_LEN;    // Subtract command header size to get number of data bytes in this packet.
-                tms_tdi    = (BYTE *)OutPacket + JTAG_CMD_HDR_LEN; // Pointer to TMS+TDI bits that follow command bytes in first packet.
+                flags &= ( PUT_TDI_MASK | PUT_TMS_MASK | GET_TDO_MASK | TMS_RLE_MASK | RAW_ORDER_MASK );
+
+                StartOutData( JTAG_CMD_HDR_LEN );          // Point to TMS+TDI bits that follow command bytes.
                 tdo        = (BYTE *)InPacket;             // Pointer to buffer for storing TDO bits.
 
-                switch ( flags )
+                if ( flags & TMS_RLE_MASK )
                 {
-                    case GET_TDO_MASK:
-                        // If we are only getting TDO bits from the FPGA, then the outbound packet from the PC 
-                        // only contains the command header (no TMS or TDI bits). But we still set the length as 
-                        // if there were so the following loop will behave correctly.
-                        OutPacketLength = USBGEN_EP_SIZE;
-                        // *** Fall-through to the next case. Do not break! ***
-                    case PUT_TDI_MASK:
-                        #if USE_MSSP
-                        // Use the MSSP for speed if only sending TDI bits or only receiving TDO bits.
-                        TCK_TRIS          = INPUT_PIN; // Disable the TCK output so that the clock won't glitch when the MSSP is enabled.
-                        SSPCON1bits.SSPEN = 1; // Enable the MSSP.
-                        TCK_TRIS          = OUTPUT_PIN; // Enable the TCK output after the MSSP glitch is over.
-                        #endif
-                        break;
-                    default:
-                        // The rest of the modes use bit-banging to send the JTAG bits.
+                    // TMS comes from the list of runs, so there are only TDI bits in the packets.
+                    flags &= ~PUT_TMS_MASK;
+                    if ( !GetTmsRuns() )
+                    {
+                        // Too many runs, so ignore the command. Skip its TDI bits so they aren't taken for commands,
+                        // and answer with just the command as a rejected SCAN_DR_SEGS_CMD does.
+                        cmd_status |= STATUS_BAD_PARAM;
+                        if ( flags & PUT_TDI_MASK )
+                        {
+                            for ( num_bytes = ( num_clks + 7 ) / 8; num_bytes != 0U; num_bytes-- )
+                                GetOutByte( 0 );
+                        }
+                        if ( flags & GET_TDO_MASK )
+                        {
+                            crc_tdo          = FALSE;
+                            InPacket->cmd    = cmd;
+                            num_return_bytes = 1;
+                        }
                         break;
+                    }
                 }
+                if ( flags & PUT_TMS_MASK )
+                    flags &= ~RAW_ORDER_MASK;   // The raw bit-order only applies when the packets hold just TDI bits.
+                if ( ( flags & GET_TDO_MASK ) && !crc_tdo )
+                    StartTdoCapture( flags );
 
-                // Process the first M-1 of M packets that are completely filled with TMS+TDI bits.
-                // (We fake the out-bound packet length for the case where we are just collecting TDO bits without TMS/TDI.)
-                while ( num_bytes > OutPacketLength )
-                {
-                    // Reduce the number of bytes left to process NOW, before OutPacketLength changes at the loop bottom!
-                    num_bytes -= OutPacketLength;
+                // Process the packets of TMS+TDI bits and collect the TDO bits.
+                ShiftJtagStream( flags, num_clks );
 
-                    if ( blink_counter == 0U )
+                // Keep track of the TAP state if TMS was held at a constant level. Otherwise, it is lost.
+                if ( flags & ( PUT_TMS_MASK | TMS_RLE_MASK ) )
+                    tap_state = TAP_UNKNOWN;
+                else
+                    TapTrack( TMS, num_clks );
+
+                // This sets the number of bytes that will be returned from this final packet to the PC.
+                if( flags & GET_TDO_MASK )
+                    num_return_bytes = tdo - (BYTE *)InPacket;
+                break;
+
+            case SCAN_IR_CMD:   // Shift bits through the IR or DR and then move the TAP to an end state.
+            case SCAN_DR_CMD:
+                num_clks  = OutPacket->num_clks;
+                flags     = OutPacket->flags;
+                end_state = OutPacket->end_state;
+                if ( ( end_state != TAP_RESET ) && ( end_state != TAP_IDLE ) && ( end_state != TAP_PAUSE_DR ) && ( end_state != TAP_PAUSE_IR ) )
+                    end_state = TAP_IDLE;   // Only stable states are allowed at the end of a scan.
+
+                // Move the TAP to the Shift-IR or Shift-DR state.
+                TapGoto( cmd == SCAN_IR_CMD ? TAP_SHIFT_IR : TAP_SHIFT_DR );
+
+                if ( num_clks != 0U )
+                {
+                    if ( !( flags & PUT_TDI_MASK ) )
                     {
-                        blink_counter = NUM_ACTIVITY_BLINKS;   // Keep LED blinking during this command to indicate activity.
+                        TDI = ( flags & TDI_VAL_MASK ) ? 1 : 0; // No TDI bits in packets, so set TDI to the static value indicated in the flag bit.
                     }
-                    // Process the TMS & TDI bytes in the packet and collect the TDO bits.
-                    switch ( flags )
-                    {
-                        case GET_TDO_MASK:  // Just gather TDO bits
-                            #if USE_MSSP
-                            {
-                                buffer_cntr       = OutPacketLength;
-                                save_FSR0         = FSR0;
-                                TBLPTR            = (UINT24)reverse_bits; // Setup the pointer to the bit-order table.
-                                FSR0              = (WORD)tdo;
-                                _asm
-                                MOVLW   0                       // Load the SPI transmitter with 0's
-                                MOVWF SSPBUF, ACCESS            //   so TDI is cleared while TDO is collected.
-                                NOP                             // The NOPs are used to insert delay while the SSPBUF is tx/rx'ed.
-                                NOP
-                                NOP
-                                NOP
-                                NOP
-                                NOP
-PRI_TAP_LOOP_2:
-                                NOP
-                                NOP
-                                DCFSNZ buffer_cntr, 1, ACCESS
-                                BRA PRI_TAP_LOOP_3
-                                MOVFF SSPBUF, TBLPTRL           // Get the TDO byte that was received and use it to index into the bit-order table.
-                                MOVWF SSPBUF, ACCESS
-                                TBLRD                           // TABLAT now contains the TDO byte in the proper bit-order.
-                                MOVFF TABLAT, POSTINC0          // Store the TDO byte into the buffer and inc. the pointer.
-                                BRA PRI_TAP_LOOP_2
-PRI_TAP_LOOP_3:
-                                MOVFF SSPBUF, TBLPTRL           // Get the TDO byte that was received and use it to index into the bit-order table.
-                                TBLRD                           // TABLAT now contains the TDO byte in the proper bit-order.
-                                MOVFF TABLAT, POSTINC0          // Store the TDO byte into the buffer and inc. the pointer.
-                                _endasm                                
-                                FSR0              = save_FSR0;
-                                tdo += OutPacketLength; // Update pointer because it's used for packet length later.
-                                TCK = 0;
-                            }
-                            #else
-                            {
-                                for ( buffer_cntr = OutPacketLength; buffer_cntr != 0U; buffer_cntr-- )
-                                {
-                                    tdo_byte = 0; // Clear byte for receiving TDO bits.
-                                    for ( bit_cntr = 8, bit_mask = 0x01; bit_cntr != 0U; bit_cntr--, bit_mask <<= 1 )
-                                    {
-                                        if ( TDO )
-                                            tdo_byte |= bit_mask;
-                                        TCK = 1;
-                                        TCK = 0;
-                                    }
-                                    *tdo++ = tdo_byte; // Store received TDO bits into the outgoing packet.
-                                }
-                            }
-                            #endif
-                            break;
+                    flags &= ( PUT_TDI_MASK | GET_TDO_MASK | RAW_ORDER_MASK );
 
-                        case PUT_TDI_MASK:  // Just output the TDI bits to the FPGA.
-                            #if USE_MSSP
-                            {
-                                buffer_cntr       = OutPacketLength;
-                                save_FSR0         = FSR0;
-                                TBLPTR            = (UINT24)reverse_bits; // Setup the pointer to the bit-order table.
-                                FSR0              = (WORD)tms_tdi;
-                                _asm
-                                MOVFF POSTINC0, TBLPTRL         // Get the current TDI byte and use it to index into the bit-order table.
-                                TBLRD                           // TABLAT now contains the TDI byte in the proper bit-order.
-                                MOVFF TABLAT, SSPBUF            // Load TDI byte into SPI transmitter.
-                                NOP
-                                NOP
-PRI_TAP_LOOP_0:
-                                DCFSNZ buffer_cntr, 1, ACCESS   // Decrement the buffer counter and continue if not zero
-                                BRA PRI_TAP_LOOP_1
-                                MOVFF POSTINC0, TBLPTRL         // Get the current TDI byte and use it to index into the bit-order table.
-                                TBLRD                           // TABLAT now contains the TDI byte in the proper bit-order.
-                                MOVFF SSPBUF, TBLPTRL           // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
-                                MOVFF TABLAT, SSPBUF            // Load TDI byte into SPI transmitter ASAP.
-                                BRA PRI_TAP_LOOP_0
-PRI_TAP_LOOP_1:
-                                NOP
-                                NOP
-                                NOP
-                                MOVFF SSPBUF, TBLPTRL           // Get the TDO byte just to clear the buffer-full flag (don't use TDO).
-                                _endasm
-                                TCK = 0;
-                                FSR0              = save_FSR0;
-                            }
-                            #else
-                            {
-                                for ( buffer_cntr = OutPacketLength; buffer_cntr != 0U; buffer_cntr-- )
-                                {
-                                    tdi_byte = *tms_tdi++;
-                                    for ( bit_cntr = 8, bit_mask = 0x01; bit_cntr != 0U; bit_cntr--, bit_mask <<= 1 )
-                                    {
-                                        TDI = tdi_byte & bit_mask ? 1 : 0;
-                                        TCK = 1;
-                                        TCK = 0;
-                                    }
-                                }
-                            }
-                            #endif
-                            break;
+                    StartOutData( SCAN_CMD_HDR_LEN );   // Point to TDI bits that follow command bytes.
+                    tdo      = (BYTE *)InPacket;
+                    if ( flags & GET_TDO_MASK )
+                        StartTdoCapture( flags );
 
-                        case 0:
-                            // No TDI, TMS or TDO bits to handle so do nothing. (This must be an error!)
-                            break;
+                    // Shift the bits and leave the Shift state on the last one.
+                    SetScanTmsRuns( num_clks );
+                    ShiftJtagStream( flags | TMS_RLE_MASK, num_clks );
+                    tap_state = TapNextState( 1 );
 
-                        default:
-                            // Handle combination of TDI, TMS and/or TDO bits. This can be done slowly
-                            // so we don't worry about all the conditionals in the loop.
-                            buffer_cntr = OutPacketLength;
-                            if( (flags & PUT_TDI_MASK) && (flags & PUT_TMS_MASK) )
-                                buffer_cntr /= 2;
-                            for ( ; buffer_cntr != 0U; buffer_cntr-- )
-                            {
-                                if( flags & PUT_TMS_MASK )
-                                    tms_byte = *tms_tdi++;
-                                if( flags & PUT_TDI_MASK )
-                                    tdi_byte = *tms_tdi++;
-                                tdo_byte = 0; // Clear byte for receiving TDO bits.
-                                for ( bit_cntr = 8, bit_mask = 0x01; bit_cntr != 0U; bit_cntr--, bit_mask <<= 1 )
-                                {
-                                    if ( TDO )
-                                        tdo_byte |= bit_mask;
-                                    if( flags & PUT_TMS_MASK )
-                                        TMS = tms_byte & bit_mask ? 1 : 0;
-                                    if( flags & PUT_TDI_MASK )
-                                        TDI = tdi_byte & bit_mask ? 1 : 0;
-                                    TCK = 1;
-                                    TCK = 0;
-                                }
-                                if( flags & GET_TDO_MASK )
-                                    *tdo++ = tdo_byte; // Store received TDO bits into the outgoing packet.
-                            }
-                            break;
-                    } /* switch */
+                    if( flags & GET_TDO_MASK )
+                        num_return_bytes = tdo - (BYTE *)InPacket;
+                }
+
+                TapGoto( end_state );
+                break;
 
-                    // Send all the recorded TDO bits back in a complete packet.
+            case SCAN_IR_CMP_CMD:   // Shift bits through the IR or DR, compare TDO on the device and go to an end state.
+            case SCAN_DR_CMP_CMD:
+                num_clks  = OutPacket->num_clks;
+                flags     = OutPacket->flags;
+                end_state = OutPacket->end_state;
+                if ( ( end_state != TAP_RESET ) && ( end_state != TAP_IDLE ) && ( end_state != TAP_PAUSE_DR ) && ( end_state != TAP_PAUSE_IR ) )
+                    end_state = TAP_IDLE;   // Only stable states are allowed at the end of a scan.
+
+                // Move the TAP to the Shift-IR or Shift-DR state.
+                TapGoto( cmd == SCAN_IR_CMP_CMD ? TAP_SHIFT_IR : TAP_SHIFT_DR );
+
+                mismatch = NO_MISMATCH;
+                if ( num_clks != 0U )
+                {
+                    StartOutData( SCAN_CMD_HDR_LEN );   // Point to TDI, expected TDO and mask bytes that follow command bytes.
+                    mismatch  = ShiftCompareStream( flags, num_clks );
+                    tap_state = TapNextState( 1 );
+                }
+
+                TapGoto( end_state );
+                InPacket->cmd        = cmd;
+                InPacket->cmp_fail   = ( mismatch != NO_MISMATCH );
+                InPacket->cmp_offset = mismatch;
+                num_return_bytes     = CMP_RSP_LEN;
+                break;
+
+            case SCAN_DR_SEGS_CMD:  // Shift several DR segments in a row and then move the TAP to an end state.
+                flags     = OutPacket->seg_flags;
+                end_state = OutPacket->seg_end_state;
+                if ( ( end_state != TAP_RESET ) && ( end_state != TAP_IDLE ) && ( end_state != TAP_PAUSE_DR ) && ( end_state != TAP_PAUSE_IR ) )
+                    end_state = TAP_IDLE;   // Only stable states are allowed at the end of a scan.
+                num_segs  = OutPacket->num_segs;
+                if ( ( num_segs > MAX_SCAN_SEGS ) || ( SCAN_SEGS_HDR_LEN + 2 * (WORD)num_segs > OutPacketLength ) )
+                {
+                    // Too many segments, or the packet is too short to hold the list of segment lengths (which
+                    // would make StartOutData() run past its end), so ignore the command. Skip its TDI bits (if all
+                    // the segment lengths are in the header) so they aren't taken for commands, and answer with
+                    // just the command so a host waiting for TDO bits gets a short response instead of hanging.
+                    cmd_status |= STATUS_BAD_PARAM;
+                    if ( ( flags & PUT_TDI_MASK ) && ( SCAN_SEGS_HDR_LEN + 2 * (WORD)num_segs <= OutPacketLength ) )
+                    {
+                        // Add up the lengths first because the command packet is released once the TDI bits run past it.
+                        num_bytes = 0;
+                        for ( seg = 0; seg < num_segs; seg++ )
+                            num_bytes += ( (DWORD)OutPacket->seg_len[seg] + 7 ) / 8;
+                        StartOutData( SCAN_SEGS_HDR_LEN + 2 * num_segs );
+                        for ( ; num_bytes != 0U; num_bytes-- )
+                            GetOutByte( 0 );
+                    }
                     if ( flags & GET_TDO_MASK )
                     {
-                        InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)InPacket, tdo - (BYTE*)InPacket );
-                        // TDO bits have now been queued for transmission, so move pointer to next ping-pong buffer.
-                        InIndex ^= 1;
-                        // Wait until previous packet of TDO bits has been transmitted so we don't overwrite it.
-                        while ( USBHandleBusy( InHandle[InIndex] ) )
-                            ;                             // Wait until USB transmitter is not busy.
-                        InPacket = &InBuffer[InIndex];
-                        if( flags == GET_TDO_MASK )
-                        {
-                            // If we are only getting TDO bits from the FPGA and sending them over the USB link,
-                            // then there are no outbound packets coming from the PC. But we still set the length as 
-                            // if there were so this loop will still keep running until all of the TDO bits have
-                            // been sent to the PC (except for the final packet).
-                            OutPacketLength = USBGEN_EP_SIZE;
-                        }
+                        InPacket->cmd    = cmd;
+                        num_return_bytes = 1;
                     }
+                    break;
+                }
 
-                    if ( flags & ( PUT_TDI_MASK | PUT_TMS_MASK ) )
+                // Copy the segment lengths out of the packet before it gets reused.
+                for ( seg = 0; seg < num_segs; seg++ )
+                    scan_segs[seg] = OutPacket->seg_len[seg];
+
+                if ( !( flags & PUT_TDI_MASK ) )
+                {
+                    TDI = ( flags & TDI_VAL_MASK ) ? 1 : 0; // No TDI bits in packets, so set TDI to the static value indicated in the flag bit.
+                }
+                flags &= ( PUT_TDI_MASK | GET_TDO_MASK | RAW_ORDER_MASK );
+
+                StartOutData( SCAN_SEGS_HDR_LEN + 2 * num_segs ); // Point to TDI bits that follow the list of segments.
+                tdo      = (BYTE *)InPacket;
+                if ( flags & GET_TDO_MASK )
+                    StartTdoCapture( flags );
+
+                for ( seg = 0; seg < num_segs; seg++ )
+                {
+                    if ( scan_segs[seg] == 0U )
+                        continue;
+                    // Every segment after the first goes through Update-DR so the previous one takes effect,
+                    // and then straight back to Shift-DR without passing through Run-Test/Idle.
+                    if ( tap_state == TAP_EXIT1_DR )
+                        TapGoto( TAP_UPDATE_DR );
+                    TapGoto( TAP_SHIFT_DR );
+                    SetScanTmsRuns( scan_segs[seg] );
+                    ShiftJtagStream( flags | TMS_RLE_MASK, scan_segs[seg] );
+                    tap_state = TapNextState( 1 );
+                    if ( win_tdo )
                     {
-                        // This command packet has been handled, so get another.
-                        OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE );
-                        OutIndex ^= 1; // Point to next ping-pong buffer.
-
-                        // Wait until the next packet of TMS and/or TDI bits arrives.
-                        while ( USBHandleBusy( OutHandle[OutIndex] ) )
-                            ;
-                        OutPacket       = &OutBuffer[OutIndex]; // Store pointer to just-received packet.
-                        OutPacketLength = USBHandleGetLength( OutHandle[OutIndex] );    // Store length of received packet.
+                        // Pick out the window bits of the segment now so the padding in its last byte isn't
+                        // counted in the window offsets.
+                        WindowTdoBits( (BYTE *)InPacket, tdo - (BYTE *)InPacket, ( ( scan_segs[seg] - 1 ) & 0x7 ) + 1 );
+                        tdo = (BYTE *)InPacket;
                     }
+                }
 
-                    tms_tdi  = (BYTE *)OutPacket;
-                    tdo      = (BYTE *)InPacket;
-                }  // Process all but the final packet of TMS/TDI/TDO bits.
+                if( flags & GET_TDO_MASK )
+                    num_return_bytes = tdo - (BYTE *)InPacket;
 
-                #if USE_MSSP
-                TCK = 0;
-                SSPCON1bits.SSPEN = 0;  // Turn off the MSSP.  The remaining bits are transmitted bit-bang style.
-                #endif
+                TapGoto( end_state );
+                break;
 
-                // Process the final packet.
-                buffer_cntr = num_bytes;
-                if( (flags & PUT_TDI_MASK) && (flags & PUT_TMS_MASK) )
-                    buffer_cntr /= 2;
-                // This sets the number of bytes that will be returned from this final packet to the PC.
-                if( flags & GET_TDO_MASK )
-                    num_return_bytes = buffer_cntr;
-                // This is the last packet, so we can afford to be slow with conditionals in the loop.
-                for ( ; buffer_cntr != 0; buffer_cntr-- )
+            case POLL_DR_CMD:   // Repeat a DR scan until the TDO bits match or a limit is reached.
+                num_clks       = OutPacket->poll_len;
+                num_poll_bytes = ( num_clks + 7 ) / 8;
+                if ( ( num_clks == 0U ) || ( num_poll_bytes > MAX_POLL_BYTES ) )
+                {
+                    // Scan doesn't fit in the packet, so ignore the command but still answer it.
+                    cmd_status |= STATUS_BAD_PARAM;
+                    InPacket->cmd        = cmd;
+                    InPacket->poll_match = POLL_REJECTED;
+                    InPacket->poll_iters = 0;
+                    num_return_bytes     = POLL_RSP_HDR_LEN;
+                    break;
+                }
+                end_state = OutPacket->poll_end_state;
+                if ( ( end_state != TAP_RESET ) && ( end_state != TAP_IDLE ) && ( end_state != TAP_PAUSE_DR ) && ( end_state != TAP_PAUSE_IR ) )
+                    end_state = TAP_IDLE;   // Only stable states are allowed at the end of a scan.
+                poll_tdi  = OutPacket->poll_data;
+                poll_mask = poll_tdi + num_poll_bytes;
+                poll_cmp  = poll_mask + num_poll_bytes;
+
+                // Convert the time limit from milliseconds into ticks of the timer interrupt.
+                time_limit = 0;
+                if ( OutPacket->poll_time_limit != 0U )
+                    time_limit = 1 + (DWORD)OutPacket->poll_time_limit * 1000 / DO_DELAY_THRESHOLD;
+                max_iters = OutPacket->poll_max_iters;
+                if ( ( time_limit == 0U ) && ( max_iters == 0U ) )
+                    max_iters = 1;  // No limits at all, so just scan once.
+
+                // The runtest timer runs freely and counts down, so measure the time from a reading of it
+                // instead of clearing it (which could also be torn by the timer interrupt).
+                poll_start = GetRuntestTimer();
+
+                // The scans take their TDI bits from the command, so keep the place in the command stream.
+                save_tms_tdi  = tms_tdi;
+                save_out_left = out_left;
+                for ( num_iters = 0; ; )
                 {
-                    if( flags & PUT_TMS_MASK )
-                        tms_byte = *tms_tdi++;
-                    if( flags & PUT_TDI_MASK )
-                        tdi_byte = *tms_tdi++;
-                    tdo_byte = 0; // Clear byte for receiving TDO bits.
-
-                    bit_cntr = 8; // All except last byte have 8 bits to process.
-                    if( buffer_cntr == 1 )
+                    SERVICE_WAIT(); // Keep the USB stack and the control requests going while the device is polled.
+
+                    // Go through Update-DR after the previous scan so the scan is repeated without
+                    // passing through Run-Test/Idle.
+                    if ( tap_state == TAP_EXIT1_DR )
+                        TapGoto( TAP_UPDATE_DR );
+                    TapGoto( TAP_SHIFT_DR );
+
+                    // Shift the TDI bits and store the TDO bits in the response.
+                    tms_tdi  = poll_tdi;
+                    out_left = num_poll_bytes;
+                    tdo      = InPacket->poll_tdo;
+                    SetScanTmsRuns( num_clks );
+                    ShiftJtagStream( PUT_TDI_MASK | GET_TDO_MASK | TMS_RLE_MASK, num_clks );
+                    tap_state = TapNextState( 1 );
+                    num_iters++;
+
+                    // Compare the TDO bits to the expected value wherever the mask bits are set.
+                    InPacket->poll_match = 1;
+                    for ( seg = 0; seg < num_poll_bytes; seg++ )
                     {
-                        // Send the last few bits of the last byte of TDI bits.
-                        // Compute the number of bits in the final byte of the final packet.
-                        // (This computation only works because num_clks != 0.)
-                        bit_cntr = num_clks & 0x7;
-                        if ( bit_cntr == 0U )
+                        if ( ( InPacket->poll_tdo[seg] ^ poll_cmp[seg] ) & poll_mask[seg] )
                         {
-                            bit_cntr = 8U;
+                            InPacket->poll_match = 0;
+                            break;
                         }
                     }
-                    // bit_cntr was set up above.
-                    for ( bit_mask = 0x01; bit_cntr != 0U; bit_cntr--, bit_mask <<= 1 )
-                    {
-                        if ( TDO )
-                            tdo_byte |= bit_mask;
-                        if( flags & PUT_TMS_MASK )
-                            TMS = tms_byte & bit_mask ? 1 : 0;
-                        if( flags & PUT_TDI_MASK )
-                            TDI = tdi_byte & bit_mask ? 1 : 0;
-                        TCK = 1;
-                        TCK = 0;
-                    }
-                    if( flags & GET_TDO_MASK )
-                        *tdo++ = tdo_byte; // Store received TDO bits into the outgoing packet.
+                    if ( InPacket->poll_match )
+                        break;
+                    if ( num_iters == max_iters )
+                        break;
+                    if ( ( time_limit != 0U ) && ( (WORD)( poll_start - GetRuntestTimer() ) >= time_limit ) )
+                        break;
                 }
+                tms_tdi  = save_tms_tdi;
+                out_left = save_out_left;
+                TapGoto( end_state );
+
+                InPacket->cmd        = cmd;
+                InPacket->poll_iters = num_iters;
+                num_return_bytes     = POLL_RSP_HDR_LEN + num_poll_bytes;
                 break;
 
             case RUNTEST_CMD:
-                if ( OutPacket->num_tck_pulses > DO_DELAY_THRESHOLD )
+                // Pulse TCK the exact number of times with TMS held low. If the packet also holds a minimum
+                // wall time, then keep waiting after the pulses until that much time has passed.
+                StartUsTimer();
+                RuntestClocks( OutPacket->num_tck_pulses );
+                TapTrack( 0, OutPacket->num_tck_pulses );
+                if ( OutPacketLength >= RUNTEST_TIME_LEN )
+                    WaitUsTimer( OutPacket->min_time_us );
+                else
+                    T1CONbits.TMR1ON = 0;   // Disable TIMER1.
+
+                memcpy( (void *)InPacket, (void *)OutPacket, 5 );
+                num_return_bytes = ACK_BYTES( 5 ); // return the entire command as an acknowledgement
+                break;
+
+            case SET_TCK_FREQ_CMD:
+                // Pick the highest TCK frequency that doesn't exceed the requested one and remember it in EEPROM.
+                flags = GetTckCode( OutPacket->tck_freq );
+                SetTckCode( flags );
+                if ( ( ReadEeprom( TCK_FREQ_ADDR ) != flags ) || ( ReadEeprom( TCK_FREQ_CHECK_ADDR ) != (BYTE)~flags ) )
                 {
-                    // For RUNTEST with large number of TCK pulses, just use a timer.
-                    runtest_timer = 1 + OutPacket->num_tck_pulses / DO_DELAY_THRESHOLD; // Set timer for needed time delay.
-                    while ( runtest_timer )
-                    {
-                        ;   // Timer is decremented by the timer interrupt routine.
-                    }
+                    WriteEeprom( TCK_FREQ_ADDR, flags );
+                    WriteEeprom( TCK_FREQ_CHECK_ADDR, ~flags );
+                }
+                InPacket->cmd      = cmd;
+                InPacket->tck_freq = GetTckFreq( flags );   // Return the frequency that was actually set.
+                num_return_bytes   = 5;
+                break;
+
+            case SET_COMM_MODE_CMD:
+                if ( stream && out_held )
+                {
+                    // Drop the rest of the stream packet and give it back to the USB engine.
+                    OUT_RELEASE();
+                }
+                comm_mode = ( ( OutPacket->mode & ~( COMM_MODE_ZLP | COMM_MODE_TDO_RLE ) ) == COMM_MODE_STREAM ) ? COMM_MODE_STREAM : COMM_MODE_PACKET;
+                zlp_enabled = ( ( OutPacket->mode & COMM_MODE_ZLP ) != 0U );
+                #if USE_TDO_RLE
+                tdo_rle_enabled = ( ( OutPacket->mode & COMM_MODE_TDO_RLE ) != 0U );
+                #endif
+                out_held  = FALSE;
+                out_left  = 0;  // Stream mode starts with the next packet.
+                InPacket->cmd    = cmd;
+                InPacket->mode   = zlp_enabled ? ( comm_mode | COMM_MODE_ZLP ) : comm_mode;
+                #if USE_TDO_RLE
+                if ( tdo_rle_enabled )
+                    InPacket->mode |= COMM_MODE_TDO_RLE;    // Let the host know the TDO bytes will be compressed.
+                #endif
+                num_return_bytes = 2;
+                break;
+
+            case SET_EVENTS_CMD:
+#if USE_EVENT_EP
+                // Select the events to send and the ADC channel and limits. Start out from the current state
+                // so only changes from now on are reported.
+                event_mask     = OutPacket->event_mask;
+                event_adc_chan = OutPacket->adc_chan ? 0xb : 0x6;
+                event_adc_low  = OutPacket->limit_low;
+                event_adc_high = OutPacket->limit_high;
+                last_done      = DONE;
+                adc_level      = ADC_BETWEEN;
+                InPacket->cmd  = cmd;
+                num_return_bytes = ACK_BYTES( 1 );
+#else
+                cmd_status |= STATUS_BAD_CMD;   // There's no event endpoint to send the events through.
+#endif
+                break;
+
+            case RX_STATS_CMD:
+                // Report how full the receive ring has been and then clear the statistics.
+                InPacket->cmd           = cmd;
+                InPacket->rx_ring_len   = RX_RING_LEN;
+                InPacket->rx_high_water = rx_high_water;
+                InPacket->rx_full_cnt   = rx_full_cnt;
+                rx_high_water           = 0;
+                rx_full_cnt             = 0;
+                num_return_bytes        = 5;
+                break;
+
+            case SET_SERIAL_NUM_CMD:
+                // Store the serial number in EEPROM. The host sees it after the board re-enumerates.
+                for ( buffer_cntr = 0; buffer_cntr < SERIAL_NUM_MAX_LEN; buffer_cntr++ )
+                {
+                    if ( buffer_cntr < OutPacket->serial_len )
+                        WriteEeprom( SERIAL_NUM_ADDR + buffer_cntr, OutPacket->serial_num[buffer_cntr] );
+                    else
+                        WriteEeprom( SERIAL_NUM_ADDR + buffer_cntr, 0xFF );
                 }
+                LoadSerialNumber();
+                InPacket->cmd    = cmd;
+                num_return_bytes = ACK_BYTES( 1 );
+                break;
+
+            case SET_TDO_WINDOWS_CMD:
+                // Store the windows for the next command that gathers TDO bits. Reject them if they're out of
+                // order, overlap or hold more bits than will fit in the window buffer.
+                // The ack is always returned, with zero windows if they were rejected.
+                num_windows = 0;
+                win_total   = 0;
+                if ( OutPacket->num_windows > MAX_TDO_WINDOWS )
+                    cmd_status |= STATUS_BAD_PARAM;
                 else
-                    // For RUNTEST with a smaller number of TCK pulses, actually pulse the TCK pin.
-                    for ( lcntr = OutPacket->num_tck_pulses; lcntr != 0UL; lcntr-- )
+                {
+                    for ( buffer_cntr = 0; buffer_cntr < OutPacket->num_windows; buffer_cntr++ )
                     {
-                        TCK ^= 1;
-                        TCK ^= 1;
+                        win_start[buffer_cntr] = OutPacket->window[buffer_cntr].start;
+                        win_len[buffer_cntr]   = OutPacket->window[buffer_cntr].len;
+                        if ( ( win_len[buffer_cntr] == 0U ) || ( win_len[buffer_cntr] > TDO_WIN_BYTES * 8 - win_total )
+                          || ( ( buffer_cntr != 0U ) && ( win_start[buffer_cntr] < win_start[buffer_cntr - 1] + win_len[buffer_cntr - 1] ) ) )
+                        {
+                            cmd_status |= STATUS_BAD_PARAM;
+                            break;
+                        }
+                        win_total += win_len[buffer_cntr];
                     }
+                    if ( buffer_cntr == OutPacket->num_windows )
+                        num_windows = buffer_cntr;
+                }
+                InPacket->cmd         = cmd;
+                InPacket->num_windows = num_windows;
+                num_return_bytes      = ACK_BYTES( 2 );
+                break;
 
-                memcpy( (void *)InPacket, (void *)OutPacket, 5 );
-                num_return_bytes = 5; // return the entire command as an acknowledgement
+            case ENABLE_RETURN_CMD:
+                // Return acknowledgements for the commands that send them.
+                return_enabled   = TRUE;
+                InPacket->cmd    = cmd;
+                num_return_bytes = 1;
+                break;
+
+            case DISABLE_RETURN_CMD:
+                // Enter posted mode where acknowledgements are not returned. Use SYNC_CMD to check for errors.
+                return_enabled   = FALSE;
+                break;
+
+            case SYNC_CMD:
+                // Report the status accumulated since the last sync and then clear it. This is always returned.
+                InPacket->cmd      = cmd;
+                InPacket->status   = cmd_status;
+                InPacket->num_cmds = num_cmds_done;
+                cmd_status         = 0;
+                num_cmds_done      = 0;
+                num_return_bytes   = 4;
+                break;
+
+            case FLUSH_CMD:
+                // Any collected responses were already sent before getting here.
+                break;
+
+            case SET_COALESCE_CMD:
+                // Any collected responses were already sent, so it's safe to change the timeout.
+                coalesce_ticks   = OutPacket->coalesce_ticks;
+                InPacket->cmd    = cmd;
+                InPacket->coalesce_ticks = coalesce_ticks;
+                num_return_bytes = ACK_BYTES( 2 );
                 break;
 
             case PROG_CMD:
@@ -1246,14 +4494,12 @@ PRI_TAP_LOOP_1:
                     FLSHDSBL = 1;
                     FLSHDSBL_TRIS = OUTPUT_PIN;
                 }
-                num_return_bytes = 2;           // Return the entire command as an acknowledgement.
+                num_return_bytes = ACK_BYTES( 2 );  // Return the entire command as an acknowledgement.
                 break;
 
             case AIO0_ADC_CMD: //Perform an adc conversion and return the value
                 InPacket->cmd = cmd;
-                ADCON0bits.CHS = 0x6;              // select channel AN6
-                ADCON0bits.GO = 1;              // Start AD conversion
-                while(ADCON0bits.NOT_DONE);     // Wait for conversion
+                ConvertAdc( 0x6 );             // select channel AN6
                 InPacket->adc_high = ADRESH;
                 InPacket->adc_low = ADRESL;
                 num_return_bytes = 3;
@@ -1261,9 +4507,7 @@ PRI_TAP_LOOP_1:
 
             case AIO1_ADC_CMD: //Perform an adc conversion and return the value
                 InPacket->cmd = cmd;
-                ADCON0bits.CHS = 0xb;              // select channel AN11
-                ADCON0bits.GO = 1;              // Start AD conversion
-                while(ADCON0bits.NOT_DONE);     // Wait for conversion
+                ConvertAdc( 0xb );             // select channel AN11
                 InPacket->adc_high = ADRESH;
                 InPacket->adc_low = ADRESL;
                 num_return_bytes = 3;
@@ -1285,7 +4529,7 @@ PRI_TAP_LOOP_1:
                     WriteEeprom((BYTE)OutPacket->ADR.pAdr + buffer_cntr, OutPacket->data[buffer_cntr]);
                 }
                 ProcessEepromFlags();   // Update uC behavior based on any new EEPROM flag settings.
-                num_return_bytes = 1;
+                num_return_bytes = ACK_BYTES( 1 );
                 break;
 
             case RESET_CMD:
@@ -1300,24 +4544,108 @@ PRI_TAP_LOOP_1:
 
             default:
                 num_return_bytes = 0;
+                cmd_status |= STATUS_BAD_CMD;
                 break;
         } /* switch */
 
-        // This command packet has been handled, so get another.
-        OutHandle[OutIndex] = USBGenRead( USBGEN_EP_NUM, (BYTE *)&OutBuffer[OutIndex], USBGEN_EP_SIZE );
-        OutIndex ^= 1; // Point to next ping-pong buffer.
+        if ( crc_tdo )
+        {
+            // Return the CRC of the TDO bytes instead of the bytes themselves.
+            CrcTdoBytes( (BYTE *)InPacket, num_return_bytes );
+            InPacket->cmd      = cmd;
+            InPacket->tdo_crc  = ~tdo_crc;
+            InPacket->crc_bits = num_clks;
+            num_return_bytes   = CRC_RSP_LEN;
+        }
+        else if ( win_tdo )
+        {
+            // Return just the TDO bits in the windows. The windows are only used once.
+            WindowTdoBits( (BYTE *)InPacket, num_return_bytes, 8 );
+            for ( buffer_cntr = 0; buffer_cntr < ( win_total + 7 ) / 8; buffer_cntr++ )
+                InPacket->_byte[buffer_cntr] = win_buf[buffer_cntr];
+            num_return_bytes = buffer_cntr;
+            num_windows      = 0;
+        }
+#if USE_TDO_RLE
+        else if ( rle_tdo )
+        {
+            // Compress the last of the TDO bytes and end the pending run. A partial packet is returned below.
+            tdo = (BYTE *)InPacket + num_return_bytes;
+            PackRleTdo( TRUE );
+            num_return_bytes = rle_fill;
+        }
+#endif
+
+        if ( cmd != SYNC_CMD )
+            num_cmds_done++;
+
+#if USE_EVENT_EP
+        // Let the host know a command that can take a long time has finished.
+        if ( event_mask & EVENT_MASK_CMD )
+        {
+            switch ( cmd )
+            {
+                case TDI_CMD:
+                case TDI_RLE_CMD:
+                case TDO_CMD:
+                case TDI_TDO_CMD:
+                case JTAG_CMD:
+                case RUNTEST_CMD:
+                case SCAN_IR_CMD:
+                case SCAN_DR_CMD:
+                case SCAN_DR_SEGS_CMD:
+                case SCAN_IR_CMP_CMD:
+                case SCAN_DR_CMP_CMD:
+                case POLL_DR_CMD:
+                    PostEvent( EVENT_CMD_DONE, cmd, num_cmds_done );
+                    break;
+                default:
+                    break;
+            } /* switch */
+        }
+#endif
+
+        if ( !stream )
+        {
+            // This command packet has been handled, so get another.
+            OUT_RELEASE();
+        }
 
+        if ( rsp_len != NO_COALESCE )
+        {
+            // Add the response to the ones collected in the IN packet and send them if the packet is full.
+            InPacket = &InBuffer[InIndex];
+            if ( num_return_bytes != 0U )
+            {
+                if ( in_fill == 0U )
+                    in_fill_tick = GetRuntestTimer();
+                in_fill += num_return_bytes;
+                if ( in_fill >= USBGEN_EP_SIZE )
+                    FlushInPacket();
+            }
+        }
         // Packets of data are returned to the PC here.
         // The counter indicates the number of data bytes in the outgoing packet.
-        if ( num_return_bytes != 0U )
+        else if ( num_return_bytes != 0U )
         {
+            last_in_full      = ( num_return_bytes == USBGEN_EP_SIZE );
             InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)InPacket, num_return_bytes ); // Now send the packet.
-            InIndex ^= 1;
+            InIndex ^= IN_INDEX_TOGGLE;
             while ( USBHandleBusy( InHandle[InIndex] ) )
             {
-                ;                           // Wait until transmitter is not busy.
+                SERVICE_WAIT();             // Wait until transmitter is not busy.
             }
             InPacket = &InBuffer[InIndex];
         }
+
+        // End a response whose last packet was full with a zero-length packet so the host's read completes.
+        if ( zlp_enabled && last_in_full )
+        {
+            InHandle[InIndex] = USBGenWrite( USBGEN_EP_NUM, (BYTE *)InPacket, 0 );
+            InIndex ^= IN_INDEX_TOGGLE;
+            while ( USBHandleBusy( InHandle[InIndex] ) )
+                SERVICE_WAIT();             // Wait until transmitter is not busy.
+            InPacket = &InBuffer[InIndex];
+        }
     }
 } /* ServiceRequests */
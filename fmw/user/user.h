@@ -29,6 +29,9 @@ extern WORD runtest_timer;
 
 void UserInit( void );
 void ServiceRequests( void );
+void ServiceSerialNumRequest( void );
+void ServiceVendorRequest( void );
+void FillRxRing( void );
 void ProcessIO( void );
 void BlinkLED( void );
 